@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+
+# Benchmarks the C demos as Linux programs: builds them with ./build.sh hosted,
+# runs every demo with scripted keys and prints the time per frame (or per
+# render) and the numbers of utils/perf.h. The last screen of every demo is
+# written to bin/hosted/<demo>.ppm.
+#
+# ./bench.sh [cores], the screen is HOSTED_WIDTH x HOSTED_HEIGHT, 640 x 480 by
+# default
+
+set -e
+
+./build.sh hosted
+
+export HOSTED_WIDTH=${HOSTED_WIDTH:-640}
+export HOSTED_HEIGHT=${HOSTED_HEIGHT:-480}
+if [ -n "$1" ]; then
+	export HOSTED_CORES=$1
+fi
+
+OUT=bin/hosted
+
+# run <demo> <keys>
+run() {
+	echo "$1"
+	HOSTED_INPUT="$2 dump=$OUT/$1.ppm" $OUT/$1 2>&1 > $OUT/$1.txt | sed 's/^hosted: /  /'
+	grep -E '^(FRAME|TRIANGLES|PIXELS|RAYS|IPC|BUSY)' $OUT/$1.txt | sed 's/^/  /' || true
+}
+
+run color-plasma "space 200"
+run color-plasma-avx2 "space 200"
+run 3d-model-loader "space 200"
+run 3d-model-loader-avx2 "space 200"
+run cube3d "space 10"
+run raytrace "x x"
+run raytrace-avx2 "x x"
+run gavare ""
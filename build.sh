@@ -3,6 +3,31 @@
 CFLAGS="-c -m64 -nostdlib -nostartfiles -nodefaultlibs -ffreestanding -falign-functions=16 -fomit-frame-pointer -mno-red-zone -fno-builtin -fno-stack-protector"
 OPTIMIZE="-O3"
 
+# ./build.sh hosted builds the C demos as Linux programs in bin/hosted, for
+# profiling, benchmarks and image checks (see bench.sh, check.sh and
+# src/hosted/libBareMetal.c)
+if [ "$1" = "hosted" ]; then
+	HOSTED="-m64 -g -fno-builtin -fno-omit-frame-pointer -mno-red-zone -pthread"
+	mkdir -p bin/hosted
+	cd src
+	gcc $HOSTED $OPTIMIZE -c -o ../bin/hosted/libBareMetal.o hosted/libBareMetal.c
+	gcc -O2 -o ../bin/hosted/compare hosted/compare.c -lm
+	HOSTED="$HOSTED $OPTIMIZE -include hosted/hosted.h ../bin/hosted/libBareMetal.o"
+	gcc -o ../bin/hosted/raytrace raytrace.c $HOSTED
+	gcc -o ../bin/hosted/raytrace-sse -DPACKET=4 raytrace.c $HOSTED
+	gcc -o ../bin/hosted/raytrace-avx2 -DPACKET=8 -mavx2 raytrace.c $HOSTED
+	gcc -o ../bin/hosted/gavare -fwrapv gavare.c $HOSTED
+	gcc -o ../bin/hosted/cube3d cube3d.c $HOSTED
+	gcc -o ../bin/hosted/color-plasma color-plasma.c $HOSTED
+	gcc -o ../bin/hosted/color-plasma-avx2 -mavx2 color-plasma.c $HOSTED
+	gcc -o ../bin/hosted/3d-model-loader ./3d-model-loader/3d-model-loader.c $HOSTED
+	gcc -o ../bin/hosted/3d-model-loader-avx2 -mavx2 ./3d-model-loader/3d-model-loader.c $HOSTED
+	gcc -o ../bin/hosted/3d-model-loader-scanline -DS3L_RASTERIZER=0 ./3d-model-loader/3d-model-loader.c $HOSTED
+	gcc -o ../bin/hosted/3d-model-loader-hiz -DS3L_HI_Z=1 ./3d-model-loader/3d-model-loader.c $HOSTED
+	gcc -o ../bin/hosted/smplocks smplocks.c $HOSTED
+	exit
+fi
+
 cd src
 nasm hello.asm -o ../bin/hello.app -l ../bin/hello-debug.txt
 nasm sysinfo.asm -o ../bin/sysinfo.app -l ../bin/sysinfo-debug.txt
@@ -20,13 +45,23 @@ if [ "$(uname)" != "Darwin" ]; then
 	ld -T c.ld -o ../bin/uitestc.app crt0.o uitestc.o libBareMetal.o
 	gcc $CFLAGS $OPTIMIZE -o raytrace.o raytrace.c
 	ld -T c.ld -o ../bin/raytrace.app crt0.o raytrace.o libBareMetal.o
-	gcc $CFLAGS -o gavare.o gavare.c
+	gcc $CFLAGS $OPTIMIZE -DPACKET=4 -o raytrace-sse.o raytrace.c
+	ld -T c.ld -o ../bin/raytrace-sse.app crt0.o raytrace-sse.o libBareMetal.o
+	gcc $CFLAGS $OPTIMIZE -DPACKET=8 -mavx2 -o raytrace-avx2.o raytrace.c
+	ld -T c.ld -o ../bin/raytrace-avx2.app crt0.o raytrace-avx2.o libBareMetal.o
+	gcc $CFLAGS $OPTIMIZE -fwrapv -o gavare.o gavare.c
 	ld -T c.ld -o ../bin/gavare.app crt0.o gavare.o libBareMetal.o
 	gcc $CFLAGS -o cube3d.o cube3d.c
 	ld -T c.ld -o ../bin/cube3d.app crt0.o cube3d.o libBareMetal.o
-	gcc $CFLAGS -o color-plasma.o color-plasma.c
+	gcc $CFLAGS $OPTIMIZE -o color-plasma.o color-plasma.c
 	ld -T c.ld -o ../bin/color-plasma.app crt0.o color-plasma.o libBareMetal.o
+	gcc $CFLAGS $OPTIMIZE -mavx2 -o color-plasma-avx2.o color-plasma.c
+	ld -T c.ld -o ../bin/color-plasma-avx2.app crt0.o color-plasma-avx2.o libBareMetal.o
 	gcc $CFLAGS -o ./3d-model-loader/3d-model-loader.o ./3d-model-loader/3d-model-loader.c
 	ld -T c.ld -o ../bin/3d-model-loader.app crt0.o ./3d-model-loader/3d-model-loader.o libBareMetal.o
+	gcc $CFLAGS -mavx2 -o ./3d-model-loader/3d-model-loader-avx2.o ./3d-model-loader/3d-model-loader.c
+	ld -T c.ld -o ../bin/3d-model-loader-avx2.app crt0.o ./3d-model-loader/3d-model-loader-avx2.o libBareMetal.o
+	gcc $CFLAGS $OPTIMIZE -o smplocks.o smplocks.c
+	ld -T c.ld -o ../bin/smplocks.app crt0.o smplocks.o libBareMetal.o
 fi
 cd ..
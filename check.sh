@@ -0,0 +1,107 @@
+#!/usr/bin/env bash
+
+# Golden image checks of the renderers: renders fixed scenes with the hosted
+# build (see bench.sh) and compares them with the reference images in golden/.
+# Then runs smplocks, which checks the locks of utils/smp.h.
+#
+# The references of gavare, cube3d and the 3D model loader (without -edge or
+# -avx2) were rendered by the demos as they were before any of them was
+# optimized, so they show that the output is still the original one. gavare
+# and cube3d must match them exactly, the model loader built with the
+# scanline rasterizer matches them but for the rounding of a few pixels.
+#
+# The model loader as shipped, with the edge function rasterizer, differs
+# from the original by its more precise texture coordinates, most of all in
+# the leaves of the plant. It and its AVX2 build are checked exactly against
+# references of their own, and against the original for information only.
+# The reference of raytrace is from its scalar build, which must match it
+# exactly, the SIMD builds differ in the rounding of the shading and of the
+# rays.
+#
+# A case passes when its PSNR is at least its minimum, no color channel is
+# off by more than its maximum difference, and no 8x8 block of pixels is off
+# by more than its block difference on average (see src/hosted/compare.c).
+# The bounds are those measured with some room to spare.
+#
+# ./check.sh save     renders the references again with the current build,
+#                     only for a change meant to change the output
+# ./check.sh          renders the images and compares them
+#
+# The scenes are the same with any number of cores (HOSTED_CORES).
+
+set -e
+
+./build.sh hosted
+
+export HOSTED_WIDTH=640
+export HOSTED_HEIGHT=480
+
+OUT=bin/hosted
+GOLDEN=golden
+SAVE=0
+FAILED=0
+
+if [ "$1" = "save" ]; then
+	SAVE=1
+	mkdir -p $GOLDEN
+fi
+
+# check <case> <demo> <keys> <min PSNR in dB> <max difference> <max block difference>
+check() {
+	local time
+	time=$(HOSTED_INPUT="$3 dump=$OUT/$1.ppm" $OUT/$2 2>&1 > /dev/null | sed -n 's/^hosted: \(.*\) in total$/\1/p')
+
+	if [ -z "$4" ]; then
+		printf "%-28s %-26s info   %12s  %s\n" $1 $2 "$time" "$($OUT/compare $GOLDEN/$1.ppm $OUT/$1.ppm)"
+	elif [ $SAVE = 1 ]; then
+		cp $OUT/$1.ppm $GOLDEN/$1.ppm
+		printf "%-28s %-26s saved  %12s\n" $1 $2 "$time"
+	elif result=$($OUT/compare $GOLDEN/$1.ppm $OUT/$1.ppm $4 $5 $6); then
+		printf "%-28s %-26s pass   %12s  %s\n" $1 $2 "$time" "$result"
+	else
+		printf "%-28s %-26s FAIL   %12s  %s\n" $1 $2 "$time" "$result"
+		FAILED=1
+	fi
+}
+
+# The model is turned a few steps, the overlay (p) is off
+MODELS="house chest cat plant"
+models() {
+	local keys="space p"
+	for model in $MODELS; do
+		check 3d-model-loader$1-$model $2 "$keys 30" $3 $4 $5
+		keys="$keys space"
+	done
+}
+
+check cube3d cube3d "space d d s 1" inf 0 0
+models "" 3d-model-loader-scanline 55 160 4
+models -edge 3d-model-loader inf 0 0
+models -avx2 3d-model-loader-avx2 inf 0 0
+check gavare gavare "" inf 0 0
+
+# The render with all cores
+check raytrace raytrace "x x" inf 0 0
+
+# The builds checked against the references of others. The hierarchical
+# z-buffer of small3dlib (S3L_HI_Z) only skips what would be hidden anyway.
+if [ $SAVE = 0 ]; then
+	check raytrace raytrace-sse "x x" 36 110 12
+	check raytrace raytrace-avx2 "x x" 36 110 12
+	models -edge 3d-model-loader-hiz inf 0 0
+	models "" 3d-model-loader
+fi
+
+# The locks and counters of utils/smp.h, with every core contending for them,
+# one thread per CPU (see src/smplocks.c)
+if [ $SAVE = 0 ]; then
+	if env -u HOSTED_CORES $OUT/smplocks > $OUT/smplocks.txt 2> /dev/null; then
+		printf "%-28s %-26s pass\n" smplocks smplocks
+	else
+		printf "%-28s %-26s FAIL\n" smplocks smplocks
+		sed 's/^/  /' $OUT/smplocks.txt
+		FAILED=1
+	fi
+fi
+
+exit $FAILED
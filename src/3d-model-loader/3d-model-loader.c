@@ -2,8 +2,14 @@
 #include "../utils/debug-print.h"
 #include "../utils/keys.h"
 #include "../utils/math/math.h"
-#include "../utils/memory.h"
+#ifndef FB_MEMORY
+#define FB_MEMORY 0xFFFF80000C000000
+#endif
+#include "../utils/fb.h"
+#include "../utils/font.h"
+#include "../utils/perf.h"
 #include "../utils/rand.h"
+#include "../utils/smp.h"
 
 #define S3L_FLAT 0
 #define S3L_NEAR_CROSS_STRATEGY 0
@@ -11,22 +17,21 @@
 #define S3L_SORT 0
 #define S3L_STENCIL_BUFFER 0
 #define S3L_Z_BUFFER 1
+#define S3L_Z_BUFFER_TAGS 1
+#define S3L_BINNING 1
+#define S3L_VERTEX_CACHE 1
+#ifndef S3L_RASTERIZER
+#define S3L_RASTERIZER 1 // check.sh builds it with 0 as well
+#endif
 
-void putpixel(int x, int y, char red, char green, char blue);
-void clearScreen();
 void sampleTexture(const uint8_t *tex, int32_t u, int32_t v, uint8_t *r, uint8_t *g, uint8_t *b);
 
-unsigned char *frame_buffer;
-unsigned char *video_memory;
-unsigned char *cli_save;
-uint16_t x_res, y_res, offset_x, offset_y;
-uint8_t depth;
-uint64_t frameBufferSize;
+uint16_t offset_x, offset_y;
 
 #define S3L_RESOLUTION_X 600
 #define S3L_RESOLUTION_Y 400
 
-#define S3L_PIXEL_FUNCTION drawPixel
+#define S3L_SPAN_FUNCTION drawSpan
 
 #include "../utils/small3dlib.h"
 
@@ -45,6 +50,8 @@ void printHelp(void) {
 	debug_print("  f                toggle fog\n", 0);
 	debug_print("  b                change backface culling\n", 0);
 	debug_print("  n                toggle noise\n", 0);
+	debug_print("  t                benchmark vertex cache (shown on quit)\n", 0);
+	debug_print("  p                toggle performance overlay\n", 0);
 	debug_print("  q                quit program\n", 0);
 	debug_print("Ported from the original example by Miloslav Ciz, released under CC0 1.0", 0);
 }
@@ -91,13 +98,6 @@ S3L_Scene scene;
 
 uint32_t frame = 0;
 
-void setPixel(int x, int y, char red, char green, char blue) {
-	int offset = ((y * x_res) + x) * (depth / 8);
-	frame_buffer[offset + 0] = blue;
-	frame_buffer[offset + 1] = green;
-	frame_buffer[offset + 2] = red;
-}
-
 void animate(double time)
 {
 	time = (1.0 + sin(time * 8)) / 2;
@@ -122,154 +122,258 @@ void animate(double time)
 	}
 }
 
-uint32_t previousTriangle = -1;
-S3L_Vec4 uv0, uv1, uv2;
-uint16_t l0, l1, l2;
+#define MAXCORES 256
+
+// Per triangle values, one set per drawing core as they draw different bins
+typedef struct {
+  uint32_t previousTriangle;
+  S3L_Vec4 uv0, uv1, uv2;
+  uint16_t l0, l1, l2;
+  S3L_Vec4 n0, n1, n2, nt;
+} __attribute__((aligned(64))) TriangleCache;
+
+TriangleCache caches[MAXCORES];
+
+// Random numbers for the noise, a generator per drawing core
+typedef struct {
+  rand_state state;
+} __attribute__((aligned(64))) NoiseRandom;
+
+NoiseRandom noiseRandom[MAXCORES];
+
 S3L_Vec4 toLight;
 int8_t light = 1;
 int8_t fog = 0;
 int8_t noise = 0;
 int8_t wire = 0;
+int8_t overlay = 1;
 int8_t transparency = 0;
 int8_t mode = 0;
-S3L_Vec4 n0, n1, n2, nt;
 
-void drawPixel(S3L_PixelInfo *p) {
-  if (p->triangleID != previousTriangle) {
-    if (mode == MODE_TEXTUERED) {
-      S3L_getIndexedTriangleValues(p->triangleIndex, uvIndices, uvs, 2, &uv0,
-                                   &uv1, &uv2);
-    } else if (mode == MODE_NORMAL_SHARP) {
-      S3L_Vec4 v0, v1, v2;
-      S3L_getIndexedTriangleValues(p->triangleIndex, model.triangles,
-                                   model.vertices, 3, &v0, &v1, &v2);
+// Shades the pixels of a span in display mode m, which is a constant in each
+// call so that the mode switch is resolved outside of the pixel loop
+static inline __attribute__((always_inline)) void shadeSpan(S3L_SpanInfo *s, TriangleCache *c, const int8_t m) {
+  // the flags can't change during a frame, keep them out of the loop
+  const int8_t lit = light, fogged = fog, noisy = noise, wireframe = wire,
+               transparentRed = transparency;
+
+  uint32_t *pixel = fb.row[offset_y + s->y] + offset_x + s->x;
+  uint32_t shaded = 0;
+  S3L_Unit b0 = s->barycentric[0], b1 = s->barycentric[1], z = s->depth;
+
+  for (uint8_t i = 0; i < s->length; i++, pixel++, b0 += s->barycentricStep[0],
+       b1 += s->barycentricStep[1], z += s->depthStep) {
+    if (!((s->mask >> i) & 1))
+      continue;
 
-      S3L_triangleNormal(v0, v1, v2, &nt);
+    S3L_Unit bar[3];
 
-      nt.x = S3L_clamp(128 + nt.x / 4, 0, 255);
-      nt.y = S3L_clamp(128 + nt.y / 4, 0, 255);
-      nt.z = S3L_clamp(128 + nt.z / 4, 0, 255);
+    bar[0] = S3L_clamp(b0 >> S3L_SPAN_FRACTION, 0, S3L_F);
+    bar[1] = S3L_clamp(b1 >> S3L_SPAN_FRACTION, 0, S3L_F - bar[0]);
+    bar[2] = S3L_F - bar[0] - bar[1];
+
+    if (wireframe)
+      if (bar[0] != 0 && bar[1] != 0 && bar[2] != 0)
+        continue;
+
+    uint8_t r = 0, g = 0, b = 0;
+
+    int8_t transparent = 0;
+
+    switch (m) {
+    case MODE_TEXTUERED: {
+      S3L_Unit uv[2];
+
+      uv[0] = S3L_interpolateBarycentric(c->uv0.x, c->uv1.x, c->uv2.x, bar);
+      uv[1] = S3L_interpolateBarycentric(c->uv0.y, c->uv1.y, c->uv2.y, bar);
+
+      sampleTexture(texture, uv[0] / 4, uv[1] / 4, &r, &g, &b);
+
+      if (transparentRed && r == 255 && g == 0 && b == 0)
+        transparent = 1;
+
+      break;
     }
 
-    if (light || mode == MODE_NORMAL_SMOOTH) {
-      S3L_getIndexedTriangleValues(p->triangleIndex, model.triangles, normals,
-                                   3, &n0, &n1, &n2);
+    case MODE_SINGLE_COLOR: {
+      r = 128;
+      g = 128;
+      b = 128;
 
-      l0 = 256 + S3L_clamp(S3L_vec3Dot(n0, toLight), -511, 511) / 2;
-      l1 = 256 + S3L_clamp(S3L_vec3Dot(n1, toLight), -511, 511) / 2;
-      l2 = 256 + S3L_clamp(S3L_vec3Dot(n2, toLight), -511, 511) / 2;
+      break;
     }
 
-    previousTriangle = p->triangleID;
-  }
+    case MODE_NORMAL_SMOOTH: {
+      S3L_Vec4 n;
 
-  if (wire)
-    if (p->barycentric[0] != 0 && p->barycentric[1] != 0 &&
-        p->barycentric[2] != 0)
-      return;
+      n.x = S3L_interpolateBarycentric(c->n0.x, c->n1.x, c->n2.x, bar);
+      n.y = S3L_interpolateBarycentric(c->n0.y, c->n1.y, c->n2.y, bar);
+      n.z = S3L_interpolateBarycentric(c->n0.z, c->n1.z, c->n2.z, bar);
 
-  uint8_t r = 0, g = 0, b = 0;
+      S3L_vec3Normalize(&n);
 
-  int8_t transparent = 0;
+      r = S3L_clamp(128 + n.x / 4, 0, 255);
+      g = S3L_clamp(128 + n.y / 4, 0, 255);
+      b = S3L_clamp(128 + n.z / 4, 0, 255);
 
-  switch (mode) {
-  case MODE_TEXTUERED: {
-    S3L_Unit uv[2];
+      break;
+    }
 
-    uv[0] = S3L_interpolateBarycentric(uv0.x, uv1.x, uv2.x, p->barycentric);
-    uv[1] = S3L_interpolateBarycentric(uv0.y, uv1.y, uv2.y, p->barycentric);
+    case MODE_NORMAL_SHARP: {
+      r = c->nt.x;
+      g = c->nt.y;
+      b = c->nt.z;
+      break;
+    }
 
-    sampleTexture(texture, uv[0] / 4, uv[1] / 4, &r, &g, &b);
+    case MODE_BARYCENTRIC: {
+      r = bar[0] >> 1;
+      g = bar[1] >> 1;
+      b = bar[2] >> 1;
+      break;
+    }
 
-    if (transparency && r == 255 && g == 0 && b == 0)
-      transparent = 1;
+    case MODE_TRIANGLE_INDEX: {
+      r = S3L_min(s->triangleIndex, 255);
+      g = r;
+      b = r;
+    }
 
-    break;
-  }
+    default:
+      break;
+    }
 
-  case MODE_SINGLE_COLOR: {
-    r = 128;
-    g = 128;
-    b = 128;
+    if (lit) {
+      int16_t l = S3L_interpolateBarycentric(c->l0, c->l1, c->l2, bar);
 
-    break;
-  }
+      r = S3L_clamp((((int16_t)r) * l) / S3L_F, 0, 255);
+      g = S3L_clamp((((int16_t)g) * l) / S3L_F, 0, 255);
+      b = S3L_clamp((((int16_t)b) * l) / S3L_F, 0, 255);
+    }
 
-  case MODE_NORMAL_SMOOTH: {
-    S3L_Vec4 n;
+    if (fogged) {
+      int16_t f = (((z >> S3L_SPAN_FRACTION) - S3L_NEAR) * 255) / (S3L_F * 64);
 
-    n.x = S3L_interpolateBarycentric(n0.x, n1.x, n2.x, p->barycentric);
-    n.y = S3L_interpolateBarycentric(n0.y, n1.y, n2.y, p->barycentric);
-    n.z = S3L_interpolateBarycentric(n0.z, n1.z, n2.z, p->barycentric);
+      f *= 2;
 
-    S3L_vec3Normalize(&n);
+      r = S3L_clamp(((int16_t)r) + f, 0, 255);
+      g = S3L_clamp(((int16_t)g) + f, 0, 255);
+      b = S3L_clamp(((int16_t)b) + f, 0, 255);
+    }
 
-    r = S3L_clamp(128 + n.x / 4, 0, 255);
-    g = S3L_clamp(128 + n.y / 4, 0, 255);
-    b = S3L_clamp(128 + n.z / 4, 0, 255);
+    if (transparent) {
+      S3L_zBufferWrite(s->x + i, s->y, s->previousZ[i]);
+      continue;
+    }
 
-    break;
-  }
+    if (noisy) {
+      uint32_t n = rand_next(&noiseRandom[s->worker].state);
+      uint32_t x = offset_x + s->x + i + (n >> 24) % 8, y = offset_y + s->y + (n >> 29);
 
-  case MODE_NORMAL_SHARP: {
-    r = nt.x;
-    g = nt.y;
-    b = nt.z;
-    break;
-  }
+      if (x < fb.width && y < fb.height)
+        fb_putpixel(x, y, fb_rgb(r, g, b));
+    } else {
+      *pixel = fb_rgb(r, g, b);
+    }
 
-  case MODE_BARYCENTRIC: {
-    r = p->barycentric[0] >> 1;
-    g = p->barycentric[1] >> 1;
-    b = p->barycentric[2] >> 1;
-    break;
+    shaded++;
   }
 
-  case MODE_TRIANGLE_INDEX: {
-    r = S3L_min(p->triangleIndex, 255);
-    g = r;
-    b = r;
-  }
+  perf_count(s->worker, PERF_PIXELS, shaded);
+}
 
-  default:
-    break;
-  }
+void drawSpan(S3L_SpanInfo *s) {
+  TriangleCache *c = &caches[s->worker];
 
-  if (light) {
-    int16_t l = S3L_interpolateBarycentric(l0, l1, l2, p->barycentric);
+  if (s->triangleID != c->previousTriangle) {
+    if (mode == MODE_TEXTUERED) {
+      S3L_getIndexedTriangleValues(s->triangleIndex, uvIndices, uvs, 2,
+                                   &c->uv0, &c->uv1, &c->uv2);
+    } else if (mode == MODE_NORMAL_SHARP) {
+      S3L_Vec4 v0, v1, v2;
+      S3L_getIndexedTriangleValues(s->triangleIndex, model.triangles,
+                                   model.vertices, 3, &v0, &v1, &v2);
 
-    r = S3L_clamp((((int16_t)r) * l) / S3L_F, 0, 255);
-    g = S3L_clamp((((int16_t)g) * l) / S3L_F, 0, 255);
-    b = S3L_clamp((((int16_t)b) * l) / S3L_F, 0, 255);
-  }
+      S3L_triangleNormal(v0, v1, v2, &c->nt);
 
-  if (fog) {
-    int16_t f = ((p->depth - S3L_NEAR) * 255) / (S3L_F * 64);
+      c->nt.x = S3L_clamp(128 + c->nt.x / 4, 0, 255);
+      c->nt.y = S3L_clamp(128 + c->nt.y / 4, 0, 255);
+      c->nt.z = S3L_clamp(128 + c->nt.z / 4, 0, 255);
+    }
 
-    f *= 2;
+    if (light || mode == MODE_NORMAL_SMOOTH) {
+      S3L_getIndexedTriangleValues(s->triangleIndex, model.triangles, normals,
+                                   3, &c->n0, &c->n1, &c->n2);
 
-    r = S3L_clamp(((int16_t)r) + f, 0, 255);
-    g = S3L_clamp(((int16_t)g) + f, 0, 255);
-    b = S3L_clamp(((int16_t)b) + f, 0, 255);
+      c->l0 = 256 + S3L_clamp(S3L_vec3Dot(c->n0, toLight), -511, 511) / 2;
+      c->l1 = 256 + S3L_clamp(S3L_vec3Dot(c->n1, toLight), -511, 511) / 2;
+      c->l2 = 256 + S3L_clamp(S3L_vec3Dot(c->n2, toLight), -511, 511) / 2;
+    }
+
+    c->previousTriangle = s->triangleID;
   }
 
-  if (transparency && transparent) {
-    S3L_zBufferWrite(p->x, p->y, p->previousZ);
-    return;
+  switch (mode) {
+  case MODE_TEXTUERED:
+    shadeSpan(s, c, MODE_TEXTUERED);
+    break;
+  case MODE_SINGLE_COLOR:
+    shadeSpan(s, c, MODE_SINGLE_COLOR);
+    break;
+  case MODE_NORMAL_SMOOTH:
+    shadeSpan(s, c, MODE_NORMAL_SMOOTH);
+    break;
+  case MODE_NORMAL_SHARP:
+    shadeSpan(s, c, MODE_NORMAL_SHARP);
+    break;
+  case MODE_BARYCENTRIC:
+    shadeSpan(s, c, MODE_BARYCENTRIC);
+    break;
+  default:
+    shadeSpan(s, c, MODE_TRIANGLE_INDEX);
+    break;
   }
+}
 
-  if (noise)
-    setPixel(offset_x + p->x + rand() % 8, offset_y + p->y + rand() % 8, r, g, b);
-  else
-    setPixel(offset_x + p->x,offset_y + p->y, r, g, b);
+// Task of the other workers, draws bins until none are left
+void drawWorker(void *arg, uint32_t worker) {
+  perf_begin(worker);
+  S3L_drawBins(worker);
+  perf_end(worker);
 }
 
-void switchBuffers() { memcpy(video_memory, frame_buffer, frameBufferSize); }
+// Marks the z-buffer tiles drawn to in this frame for presenting, noise
+// scatters the pixels up to 7 pixels right and down of where they belong
+void markDrawn(void) {
+  if (noise) {
+    fb_mark(offset_x, offset_y, S3L_RESOLUTION_X + 7, S3L_RESOLUTION_Y + 7);
+    return;
+  }
+
+  for (uint32_t tile = 0; tile < S3L_Z_TILES_X * S3L_Z_TILES_Y; tile++)
+    if (S3L_zBufferTags[tile] == S3L_zBufferTag)
+      fb_mark(offset_x + (tile % S3L_Z_TILES_X) * S3L_Z_TILE,
+                   offset_y + (tile / S3L_Z_TILES_X) * S3L_Z_TILE, S3L_Z_TILE,
+                   S3L_Z_TILE);
+}
 
 void draw(void) {
+  perf_begin(0);
   S3L_newFrame();
-  clearScreen();
-  S3L_drawScene(scene);
+  fb_clear();
+  S3L_binScene(scene);
+  perf_count(0, PERF_TRIANGLES, S3L_binnedTriangleCount);
+
+  smp_future drawn = {0};
+  for (uint32_t i = 1; i < smp.workers; i++)
+    smp_queue(drawWorker, 0, &drawn);
+  smp_wake(smp.workers - 1);
+
+  S3L_drawBins(0);
+  perf_end(0);
+  smp_wait(&drawn);
+
+  markDrawn();
 }
 
 void setModel(uint32_t index) {
@@ -307,37 +411,97 @@ void setModel(uint32_t index) {
   }
 }
 
-int16_t fps = 0;
+#define BENCHMARK_FRAMES 64
+
+const char *modelNames[] = {"house", "chest", "cat  ", "plant"};
+int64_t geometryCycles[4][2]; // per model, vertex cache off/on
+int64_t frameCycles[4][2];
+int8_t benchmarked = 0;
+
+// Measure TSC cycles per frame of every model with and without vertex cache
+void benchmark(int8_t current) {
+	for (int m = 0; m < 4; m++) {
+		setModel(m);
+
+		for (int c = 0; c < 2; c++) {
+			S3L_vertexCacheEnabled = c;
+
+			uint64_t start = b_system(TSC, 0, 0);
+
+			for (int i = 0; i < BENCHMARK_FRAMES; i++) {
+				model.transform.rotation.y += 8;
+				S3L_binScene(scene); // projection and binning only
+			}
+
+			uint64_t middle = b_system(TSC, 0, 0);
+
+			for (int i = 0; i < BENCHMARK_FRAMES; i++) {
+				model.transform.rotation.y += 8;
+				draw();
+			}
+
+			uint64_t end = b_system(TSC, 0, 0);
+
+			geometryCycles[m][c] = (middle - start) / BENCHMARK_FRAMES;
+			frameCycles[m][c] = (end - middle) / BENCHMARK_FRAMES;
+		}
+	}
+
+	S3L_vertexCacheEnabled = 1;
+	setModel(current);
+	benchmarked = 1;
+	perf_reset(); // the benchmark frames aren't counted as frames
+}
+
+void printBenchmark(void) {
+	debug_print("\nVertex cache benchmark, TSC cycles per frame (off -> on):\n", 0);
+
+	for (int m = 0; m < 4; m++) {
+		debug_print("  %s", (void *)modelNames[m]);
+		debug_print("  geometry %ld", &geometryCycles[m][0]);
+		debug_print(" -> %ld", &geometryCycles[m][1]);
+		debug_print("  frame %ld", &frameCycles[m][0]);
+		debug_print(" -> %ld\n", &frameCycles[m][1]);
+	}
+}
+
+// Prints the numbers of the performance overlay
+void printPerf(void) {
+	char text[PERF_LINES][PERF_LINE];
+	uint32_t lines = perf_text(text);
+
+	for (uint32_t i = 0; i < lines; i++)
+		debug_print("\n%s", text[i]);
+}
 
 int main(void) {
-	// Gather video memory address, x & y resolution, and BPP
-	video_memory = (unsigned char *)(*(uint64_t *)(0x5080));
-	x_res = *(uint16_t *)(0x5088);
-	y_res = *(uint16_t *)(0x508A);
-	offset_x = (x_res - S3L_RESOLUTION_X) / 2;
-	offset_y = (y_res - S3L_RESOLUTION_Y) / 2;
-	depth = 32;
-	frameBufferSize = x_res * y_res * 4;
-	frame_buffer = (unsigned char *)(0xFFFF80000F000000);
-	cli_save = (unsigned char *)(0xFFFF80000C000000);
+	// Triple buffered on 3 or more cores, the presenting core doesn't draw
+	fb_init(b_system(SMP_NUMCORES, 0, 0) > 2 ? 3 : 2);
+	offset_x = (fb.width - S3L_RESOLUTION_X) / 2;
+	offset_y = (fb.height - S3L_RESOLUTION_Y) / 2;
 
 	int key = 0;
 	printHelp();
 	debug_print("\nPress SPACE to continue.\n", 0);
-	memcpy(cli_save, video_memory, frameBufferSize); // Save the starting screen state
+	fb_save(); // Save the starting screen state
 	int position = 0;
 
 	while (key != ASCII_SPACE) {
 		key = b_input();
 	}
 
-	frame_buffer = (unsigned char *)(0xFFFF80000F000000);
+	smp_init(fb.presenter); // every core but the one presenting
+	for (int i = 0; i < MAXCORES; i++) {
+		caches[i].previousTriangle = -1;
+		rand_seed(&noiseRandom[i].state, i + 1);
+	}
 
 	toLight.x = 10;
 	toLight.y = 10;
 	toLight.z = 10;
 
 	S3L_vec3Normalize(&toLight);
+	perf_init(0);
 
 	S3L_sceneInit(&model, 1, &scene);
 
@@ -363,7 +527,10 @@ int main(void) {
 	while (running) {
 		key = b_input();
 		draw();
-		switchBuffers();
+		perf_frame();
+		if (overlay)
+			perf_draw(8, 8, 2);
+		fb_present();
 
 
 		int16_t rotationStep = 1;
@@ -387,6 +554,9 @@ int main(void) {
 			case ASCII_w:
 				wire = !wire;
 				break;
+			case ASCII_p:
+				overlay = !overlay;
+				break;
 			case ASCII_SPACE:
 				modelIndex = (modelIndex + 1) % modelsTotal;
 				setModel(modelIndex);
@@ -409,23 +579,21 @@ int main(void) {
 			case ASCII_6:
 				mode = MODE_TRIANGLE_INDEX;
 				break;
+			case ASCII_t:
+				benchmark(modelIndex);
+				break;
 		}
 		frame++;
 	}
 
-	memcpy(video_memory, cli_save, frameBufferSize); // Restore the original screen
+	smp_stop();
+	fb_restore(); // Restore the original screen
+	if (benchmarked)
+		printBenchmark();
+	printPerf();
 	return 0;
 }
 
-void putpixel(int x, int y, char red, char green, char blue) {
-	int offset = ((y * x_res) + x) * (depth / 8);
-	frame_buffer[offset + 0] = blue;
-	frame_buffer[offset + 1] = green;
-	frame_buffer[offset + 2] = red;
-}
-
-void clearScreen() { memset(frame_buffer, 0, frameBufferSize); }
-
 void sampleTexture(const uint8_t *tex, int32_t u, int32_t v, uint8_t *r, uint8_t *g, uint8_t *b) {
 	u = S3L_wrap(u, TEXTURE_W);
 	v = S3L_wrap(v, TEXTURE_H);
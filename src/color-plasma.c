@@ -4,54 +4,61 @@
 #include "utils/debug-print.h"
 #define size_t uint64_t
 #include "utils/math/math.h"
-#include "utils/math/vector.h"
-#include "utils/memory.h"
+#include "utils/fb.h"
+#include "utils/font.h"
+#include "utils/perf.h"
+#include "utils/smp.h"
+
+// The plasma is the sum of three sine waves, one along x, one along x + y and
+// one around the center of the screen. Nothing is computed per pixel with sin:
+// the first two waves only depend on x and x + y, so a table of each is made
+// once a frame, and the radial wave is split with
+//
+//	sin(a + b) = sin(a) cos(b) + cos(a) sin(b)
+//
+// into sin(a) and cos(a), a depending on the distance to the center only and
+// kept in a map made at start, and the per frame sin(b) and cos(b). A pixel
+// is then two table loads, a map load, a multiply-add of 16 bit pairs (pmaddwd)
+// and the palette lookup, all done PLASMA_LANES pixels at a time.
+//
+// The values are fixed point, the color index times 256.
+//
+// Every row is independent, so the screen is split into horizontal bands of
+// PLASMA_BAND rows, drawn by the cores other than the presenting one with
+// smp_parallelFor.
+
+#define PLASMA_MAX_WIDTH 4096
+#define PLASMA_BAND 16
+#define PLASMA_SCALE (128 * 256 / 3) // one wave, at most a third of the range
+
+#ifdef __AVX2__
+#define PLASMA_LANES 8
+typedef int32_t plasmaVec __attribute__((vector_size(32), aligned(4)));
+typedef int16_t plasmaVec16 __attribute__((vector_size(32), aligned(4)));
+#define plasma_madd(a, b) __builtin_ia32_pmaddwd256((plasmaVec16)(a), (plasmaVec16)(b))
+#else
+#define PLASMA_LANES 4
+typedef int32_t plasmaVec __attribute__((vector_size(16), aligned(4)));
+typedef int16_t plasmaVec16 __attribute__((vector_size(16), aligned(4)));
+#define plasma_madd(a, b) __builtin_ia32_pmaddwd128((plasmaVec16)(a), (plasmaVec16)(b))
+#endif
 
-#define SCREEN_WIDTH 320
-#define SCREEN_HEIGHT 240
-
-unsigned char *frame_buffer;
-unsigned char *video_memory;
-unsigned char *cli_save;
-uint64_t frameBufferSize;
-uint16_t x_res, y_res, offset_x, offset_y;
-uint8_t depth;
-
-void putpixel(int x, int y, char red, char green, char blue);
 void b_system_delay(unsigned long long delay);
-void switchBuffers();
 void buildColorPalette();
+void plasmaInit();
 void plasmaStep(float xShift, float yShift, float radialShift);
 
-typedef struct
-{
-	unsigned char r, g, b;
-} Color;
-
 
 int main()
 {
-	// Resolution
-	x_res = *(uint16_t *)(0x5088);
-	y_res = *(uint16_t *)(0x508A);
-
-	offset_x = (x_res - SCREEN_WIDTH) / 2;
-	offset_y = (y_res - SCREEN_HEIGHT) / 2;
-
-	// Gather video memory address, x & y resolution, and BPP
-	video_memory = (unsigned char *)(*(uint64_t *)(0x5080));
-	depth = 32;
-	frameBufferSize = x_res * y_res * 4;
-	frame_buffer = (unsigned char *)(0xFFFF800000F00000);
-	memset(frame_buffer, 0, frameBufferSize);
-	cli_save = (unsigned char *)(0xFFFF800001F00000);
+	fb_init(3);
 
 	unsigned char key = 0;
-	debug_print("\nResolution %d x", &x_res);
-	debug_print(" %d \n", &y_res);
+	debug_print("\nResolution %d x", &fb.width);
+	debug_print(" %d \n", &fb.height);
 	debug_print("Commands:\nq to go back to shell\nPress SPACE to continue.", 0);
 
-	memcpy(cli_save, video_memory, frameBufferSize); // Save the starting screen state
+	fb_save(); // Save the starting screen state
 
 	while(key != ASCII_SPACE)
 	{
@@ -60,7 +67,10 @@ int main()
 
 	key = 0;
 
+	smp_init(fb.presenter); // every core but the one presenting
 	buildColorPalette();
+	plasmaInit();
+	perf_init(0);
 
 	float shiftX = 0;
 	float shiftY = 0;
@@ -73,70 +83,139 @@ int main()
 		shiftY += 2.0;
 		shiftRadial += 3.0;
 		plasmaStep(shiftX, shiftY, shiftRadial);
-		switchBuffers();
+		perf_frame();
+		perf_draw(8, 8, 2);
+		fb_present();
 	}
 
-	memcpy(video_memory, cli_save, frameBufferSize); // Restore the original screen
-}
+	smp_stop();
+	fb_restore(); // Restore the original screen
 
-static Vec2i screenCenter = {.x = SCREEN_WIDTH / 2, .y = SCREEN_HEIGHT / 2};
+	char text[PERF_LINES][PERF_LINE];
+	uint32_t lines = perf_text(text);
+	for (uint32_t i = 0; i < lines; i++)
+		debug_print("\n%s", text[i]);
+}
 
-static Color colorPalette[255];
+static uint32_t colorPalette[256];
 static const float colorToPIRelation = PI / 255.0;
 
 void buildColorPalette()
 {
-	for (int i = 0; i < 255; i++)
+	for (int i = 0; i < 256; i++)
 	{
-		colorPalette[i].r = sin(i * colorToPIRelation * 2) * 128 + 128;
-		colorPalette[i].g = sin(i * colorToPIRelation * 3) * 128 + 128;
-		colorPalette[i].b = sin(i * colorToPIRelation * 4) * 128 + 128;
+		unsigned char r = sin(i * colorToPIRelation * 2) * 128 + 128;
+		unsigned char g = sin(i * colorToPIRelation * 3) * 128 + 128;
+		unsigned char b = sin(i * colorToPIRelation * 4) * 128 + 128;
+		colorPalette[i] = fb_rgb(r, g, b);
 	}
 }
 
 void drawColorPalette()
 {
-	for (int i = 0; i < 255; i++)
+	for (int i = 0; i < 256; i++)
 	{
-		putpixel(i, 0, colorPalette[i].r, colorPalette[i].g, colorPalette[i].b);
+		fb_putpixel(i, 0, colorPalette[i]);
 	}
 }
 
-void plasmaStep(float xShift, float yShift, float radialShift)
+// sin and cos of the radial wave of every pixel, as 16 bit pairs
+static uint32_t *plasmaMap;
+static uint32_t plasmaPitch; // entries per row of the map, a multiple of PLASMA_LANES
+
+// The wave along x, plus the middle of the palette, and the wave along x + y.
+// Both are read up to PLASMA_LANES - 1 entries past the end of the screen.
+static int32_t plasmaX[PLASMA_MAX_WIDTH + PLASMA_LANES] __attribute__((aligned(32)));
+static int32_t plasmaXY[PLASMA_MAX_WIDTH + FB_MAX_HEIGHT + PLASMA_LANES];
+
+// cos and sin of the radial shift, the pair the map is multiplied by
+static uint32_t plasmaRadial;
+
+static inline uint32_t plasmaPair(float low, float high, float scale)
 {
-	float components[3] = {0};
-	// Column mayor is cache friendly (or the other way around?)
-	for (int y = 0; y < SCREEN_HEIGHT; y++)
-		for (int x = 0; x < SCREEN_WIDTH; x++)
-		{
-			unsigned char color[3] = {0};
+	return (uint16_t)(int16_t)(low * scale) | (uint32_t)(uint16_t)(int16_t)(high * scale) << 16;
+}
 
-			components[0] = sin((x + xShift) * 0.1);
-			components[1] = sin((x + y + yShift) * 0.01);
-			components[2] = sin((vec2i_distance(screenCenter, (Vec2i){x, y}) + radialShift) * 0.3); //sin((vec2i_distance(screenCenter, (Vec2i){x, y}) + radialShift) * 0.3);
+void plasmaInit()
+{
+	uint32_t width = fb.width < PLASMA_MAX_WIDTH ? fb.width : PLASMA_MAX_WIDTH;
+	float centerX = width / 2, centerY = fb.height / 2;
 
-			float result = (components[0] + components[1] + components[2]) / 3;
+	plasmaPitch = (width + PLASMA_LANES - 1) & ~(PLASMA_LANES - 1);
+	plasmaMap = (uint32_t *)fb.end;
 
-			unsigned char colorIndex = (unsigned char)(result * 128.0 + 128.0);
+	for (uint32_t y = 0; y < fb.height; y++)
+	{
+		uint32_t *map = plasmaMap + y * plasmaPitch;
 
-			putpixel(offset_x + x, offset_y + y, colorPalette[colorIndex].r, colorPalette[colorIndex].g, colorPalette[colorIndex].b);
+		for (uint32_t x = 0; x < plasmaPitch; x++)
+		{
+			float distance = sqrt((x - centerX) * (x - centerX) + (y - centerY) * (y - centerY));
+			map[x] = plasmaPair(sin(distance * 0.3), cos(distance * 0.3), 32767);
 		}
+	}
+}
 
+// Draws rows y0 to y1 - 1 of the plasma with the tables of plasmaStep
+static void plasmaRows(uint32_t y0, uint32_t y1)
+{
+	uint32_t width = fb.width < PLASMA_MAX_WIDTH ? fb.width : PLASMA_MAX_WIDTH;
+	plasmaVec radial = (plasmaVec){} + (int32_t)plasmaRadial;
+
+	for (uint32_t y = y0; y < y1; y++)
+	{
+		uint32_t *row = fb.row[y];
+		const uint32_t *map = plasmaMap + y * plasmaPitch;
+		const int32_t *xy = plasmaXY + y;
+
+		for (uint32_t x = 0; x < width; x += PLASMA_LANES)
+		{
+			plasmaVec value = *(const plasmaVec *)(plasmaX + x) + *(const plasmaVec *)(xy + x)
+			                + (plasma_madd(*(const plasmaVec *)(map + x), radial) >> 15);
+			plasmaVec index = (value >> 8) & 255;
+
+			if (x + PLASMA_LANES > width)
+			{
+				for (uint32_t i = 0; x + i < width; i++)
+					row[x + i] = colorPalette[index[i]];
+				break;
+			}
+#ifdef __AVX2__
+			*(plasmaVec *)(row + x) = __builtin_ia32_gathersiv8si((plasmaVec){}, (const int *)colorPalette, index, (plasmaVec){} - 1, 4);
+#else
+			for (int i = 0; i < PLASMA_LANES; i++)
+				row[x + i] = colorPalette[index[i]];
+#endif
+		}
+	}
+}
+
+// Draws rows y0 to y1 (not included), a task of smp_parallelFor
+static void plasmaBand(uint32_t y0, uint32_t y1, void *arg, uint32_t worker)
+{
+	perf_begin(worker);
+	plasmaRows(y0, y1);
+	perf_count(worker, PERF_PIXELS, (y1 - y0) * fb.width);
+	perf_end(worker);
 }
 
-void switchBuffers()
+void plasmaStep(float xShift, float yShift, float radialShift)
 {
-	memcpy(video_memory, frame_buffer, frameBufferSize);
+	uint32_t width = fb.width < PLASMA_MAX_WIDTH ? fb.width : PLASMA_MAX_WIDTH;
+
+	for (uint32_t x = 0; x < width + PLASMA_LANES; x++)
+		plasmaX[x] = sin((x + xShift) * 0.1) * PLASMA_SCALE + 128 * 256;
+
+	for (uint32_t i = 0; i < width + fb.height + PLASMA_LANES; i++)
+		plasmaXY[i] = sin((i + yShift) * 0.01) * PLASMA_SCALE;
+
+	plasmaRadial = plasmaPair(cos(radialShift * 0.3), sin(radialShift * 0.3), PLASMA_SCALE);
+
+	smp_parallelFor(0, fb.height, PLASMA_BAND, plasmaBand, 0);
+
+	fb_mark(0, 0, width, fb.height);
 }
 
 void b_system_delay(unsigned long long delay) {
 	asm volatile ("call *0x00100048" : : "c"(6), "a"(delay));
 }
-
-void putpixel(int x, int y, char red, char green, char blue)
-{
-	int offset = ((y * x_res) + x) * (depth / 8);
-	frame_buffer[offset+0] = blue;
-	frame_buffer[offset+1] = green;
-	frame_buffer[offset+2] = red;
-}
\ No newline at end of file
@@ -3,22 +3,18 @@
 #include "utils/keys.h"
 #include "utils/debug-print.h"
 #define size_t uint64_t
+#include "utils/fb.h"
 
-void putpixel(int x, int y, char red, char green, char blue);
 void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue);
 
-unsigned char *frame_buffer;
-unsigned char *video_memory;
-unsigned char *cli_save;
-uint16_t x_res, y_res;
-uint8_t depth;
-
-#define S3L_RESOLUTION_X x_res
-#define S3L_RESOLUTION_Y y_res
+// Signed like the screen coordinates small3dlib computes with them
+#define S3L_RESOLUTION_X ((int32_t)fb.width)
+#define S3L_RESOLUTION_Y ((int32_t)fb.height)
 
 void usleep(uint64_t microseconds);
 
-#define S3L_PIXEL_FUNCTION drawPixel
+#define S3L_SPAN_FUNCTION drawSpan
+#define S3L_RASTERIZER 1
 
 #include "utils/small3dlib.h"
 
@@ -28,23 +24,30 @@ void b_system_delay(unsigned long long delay)
 }
 
 
-void drawPixel(S3L_PixelInfo *p)
+void drawSpan(S3L_SpanInfo *s)
 {
-	char r, g, b;
-	if (p->triangleIndex == 0 || p->triangleIndex == 1 || p->triangleIndex == 4 || p->triangleIndex == 5)
+	uint32_t color;
+	if (s->triangleIndex == 0 || s->triangleIndex == 1 || s->triangleIndex == 4 || s->triangleIndex == 5)
 	{
-		r = 0; g = 255, b = 0;
+		color = fb_rgb(0, 255, 0);
 	}
-	else if (p->triangleIndex == 2 || p->triangleIndex == 3 || p->triangleIndex == 6 || p->triangleIndex == 7)
+	else if (s->triangleIndex == 2 || s->triangleIndex == 3 || s->triangleIndex == 6 || s->triangleIndex == 7)
 	{
-		r = 0; g = 0, b = 255;
+		color = fb_rgb(0, 0, 255);
 	}
 	else
 	{
-		r = 255; g = 0, b = 0;
+		color = fb_rgb(255, 0, 0);
 	}
 
-	putpixel(p->x, p->y, r, g, b);
+	uint32_t *pixel = fb.row[s->y] + s->x;
+	for (int i = 0; i < s->length; i++)
+	{
+		if (s->mask & (1 << i))
+			pixel[i] = color;
+	}
+
+	fb_mark(s->x, s->y, s->length, 1);
 }
 
 S3L_Unit cubeVertices[] = { S3L_CUBE_VERTICES(S3L_F) };
@@ -53,32 +56,12 @@ S3L_Index cubeTriangles[] = { S3L_CUBE_TRIANGLES };
 S3L_Model3D cubeModel; // 3D model, has a geometry, position, rotation etc.
 S3L_Scene scene;       // scene we'll be rendring (can have multiple models)
 
-uint64_t frameBufferSize;
-
-void *memcpy(void *dest, const void *src, size_t n)
-{
-	unsigned char *d = (unsigned char *)dest;
-	const unsigned char *s = (const unsigned char *)src;
-
-	while (n--) {
-		*d++ = *s++;
-	}
-
-	return dest;
-}
-
-void switchBuffers()
-{
-	memcpy(video_memory, frame_buffer, frameBufferSize);
-}
-
 int main(void)
 {
-	x_res = *(uint16_t *)(0x5088);
-	y_res = *(uint16_t *)(0x508A);
+	fb_init(3);
 	unsigned char key = 0;
-	debug_print("Resolution %d x", &x_res);
-	debug_print(" %d \n", &y_res);
+	debug_print("Resolution %d x", &fb.width);
+	debug_print(" %d \n", &fb.height);
 	debug_print("Commands:\nd/a/w/s to rotate the cube\nq to go back to shell\nPress SPACE to continue.", 0);
 
 	while(key != ASCII_SPACE)
@@ -86,14 +69,7 @@ int main(void)
 		key = b_input();
 	}
 
-	// Gather video memory address, x & y resolution, and BPP
-	video_memory = (unsigned char *)(*(uint64_t *)(0x5080));
-
-	depth = 32;
-	frameBufferSize = x_res * y_res * 4;
-	frame_buffer = (unsigned char *)(0xFFFF800000F00000);
-	cli_save = (unsigned char *)(0xFFFF800001F00000);
-	memcpy(cli_save, video_memory, frameBufferSize); // Save the starting screen state
+	fb_save(); // Save the starting screen state
 
 	S3L_model3DInit(
 		cubeVertices,
@@ -122,14 +98,12 @@ int main(void)
 		i++;
 		key = b_input();
 
-		// clear the screen
-		for (int j = 0; j < frameBufferSize; ++j)
-		frame_buffer[j] = 0;
+		fb_clear(); // clear what this buffer drew last time
 
 		S3L_newFrame();        // has to be called before each frame
-		S3L_drawScene(scene);  /* This starts the scene rendering. The drawPixel
+		S3L_drawScene(scene);  /* This starts the scene rendering. The drawSpan
 								function will be called to draw it. */
-		switchBuffers();
+		fb_present();
 
 		b_system_delay(100000);        // wait a bit to let the user see the frame
 
@@ -150,13 +124,5 @@ int main(void)
 				break;
 		}
 	}
-	memcpy(video_memory, cli_save, frameBufferSize); // Restore the original screen
-}
-
-void putpixel(int x, int y, char red, char green, char blue)
-{
-	int offset = ((y * x_res) + x) * (depth / 8);
-	frame_buffer[offset+0] = blue;
-	frame_buffer[offset+1] = green;
-	frame_buffer[offset+2] = red;
+	fb_restore(); // Restore the original screen
 }
@@ -1,13 +1,20 @@
 // Modified IOCCC Ray Tracer from Anders Gavare
 // https://www.ioccc.org/2004/gavare.c (see https://www.ioccc.org/2004/gavare.hint also)
 
-// gcc -c -m64 -nostdlib -nostartfiles -nodefaultlibs -o gavare.o gavare.c
-// ld -T c.ld -o gavare.app gavare.o
+// gcc -c -m64 -nostdlib -nostartfiles -nodefaultlibs -O3 -fwrapv -o gavare.o gavare.c
+// ld -T c.ld -o gavare.app crt0.o gavare.o libBareMetal.o
+
+// The state of a ray lives in a struct of its own instead of in globals, so
+// every core can trace rows at the same time. The rows are handed out to the
+// cores one at a time by smp_parallelFor. The arithmetic is the original's,
+// which relies on int overflow wrapping around (hence -fwrapv).
 
 #include <stdint.h>
+#include "libBareMetal.h"
+#include "utils/smp.h"
+#include "utils/perf.h"
 
 unsigned char *frame_buffer;
-int offset = 0;
 int X = 1024;
 int Y = 768;
 int BPP = 32;
@@ -20,78 +27,127 @@ int M = 1296;
 int N = 36;
 int O = 255;
 int P = 9;
-int _ = 1 << 15;
-int E, S, C, D, p, Z, W, Q, T, U, u, v, w, R, G, B;
-
-int F(int b);
-int I(int x, int Y, int X);
-int H(int x);
-int q(int c, int x, int y, int z, int k, int l, int m, int a, int b);
-int o(int c, int x, int y, int z, int k, int l, int m, int a);
-int n(int e, int f, int g, int h, int i, int j, int d, int a, int b, int V);
-int t(int x, int y, int a, int b);
-int r(int x, int y);
+
+// The state of a ray
+typedef struct {
+	int E, S, C, D; // Sphere found by F()
+	int p;          // Distance to the sphere tested by q()
+	int Z, W;       // Nearest sphere hit and its distance
+	int Q, T, U;    // Color
+} ray;
+
+void render(uint32_t y0, uint32_t y1, void *arg, uint32_t worker);
+void F(ray *s, int b);
+int I(int x);
+void q(ray *s, int c, int x, int y, int z, int k, int l, int m);
+void o(ray *s, int x, int y, int z, int k, int l, int m, int a);
+void n(ray *s, int e, int f, int g, int h, int i, int j, int d, int a, int b, int V);
+void r(int x, int y);
 
 int main() {
-	int x, y;
-	frame_buffer = (unsigned char *)(*(uint64_t *)(0x5080));
-	X = *(uint16_t *)(0x5088);
-	Y = *(uint16_t *)(0x508A);
-	for (y=0; y<Y; y++)
-		for (x=0; x<X; x++)
-			r(x, y); // render each pixel
+	frame_buffer = (unsigned char *)b_system(SCREEN_LFB_GET, 0, 0);
+	X = b_system(SCREEN_X_GET, 0, 0);
+	Y = b_system(SCREEN_Y_GET, 0, 0);
+	perf_init(1);
+
+	smp_init(b_system(SMP_ID, 0, 0));
+	smp_parallelFor(0, Y, 1, render, 0); // Have every core trace rows
+	smp_stop();
+
+	// Time, rays and busy time of every core
+	char text[PERF_LINES][PERF_LINE];
+	perf_frame();
+	uint32_t lines = perf_text(text);
+	for (uint32_t l = 0; l < lines; l++) {
+		uint64_t length = 0;
+		while (text[l][length])
+			length++;
+		b_output("\n", 1);
+		b_output(text[l], length);
+	}
 }
 
-int F(int b) {
-	E = "1111886:6:??AAFFHHMMOO55557799@@>>>BBBGGIIKK" [b] - 64;
-	C = "C@=::C@@==@=:C@=:C@=:C531/513/5131/31/531/53" [b] - 64;
-	S = b < 22 ? 9 : 0;
-	D = 2;
+// Traces rows y0 to y1 (not included)
+void render(uint32_t y0, uint32_t y1, void *arg, uint32_t worker) {
+	perf_begin(worker);
+	for (uint32_t y = y0; y < y1; y++)
+		for (int x = 0; x < X; x++)
+			r(x, y); // render each pixel
+	perf_count(worker, PERF_RAYS, (uint64_t)(y1 - y0) * X * A * A);
+	perf_end(worker);
 }
 
-int I(int x, int Y, int X) {
-	Y ? (X ^= Y, X * X > x ? (X ^= Y) : 0, I(x, Y / 2, X)) : (E = X);
+void F(ray *s, int b) {
+	s->E = "1111886:6:??AAFFHHMMOO55557799@@>>>BBBGGIIKK" [b] - 64;
+	s->C = "C@=::C@@==@=:C@=:C@=:C531/513/5131/31/531/53" [b] - 64;
+	s->S = b < 22 ? 9 : 0;
+	s->D = 2;
 }
 
-int H(int x) {
-	I(x, _, 0);
+// Integer square root. sqrtsd is exact for the values below 2^30, larger ones
+// are searched bit by bit like the original did, overflowing the same way.
+int I(int x) {
+	if (x < 0)
+		return 0;
+
+	if (x < 1 << 30) {
+		double d = x;
+		asm ("sqrtsd %1, %0" : "=x"(d) : "x"(d));
+		return (int)d;
+	}
+
+	int X = 0;
+	for (int Y = 1 << 15; Y; Y /= 2) {
+		X ^= Y;
+		if (X * X > x)
+			X ^= Y;
+	}
+	return X;
 }
 
-int q(int c, int x, int y, int z, int k, int l, int m, int a, int b) {
-	F(c);
-	x -= E * M;
-	y -= S * M;
-	z -= C * M;
-	b = x * x / M + y * y / M + z * z / M - D * D * M;
+void q(ray *s, int c, int x, int y, int z, int k, int l, int m) {
+	int a, b;
+
+	F(s, c);
+	x -= s->E * M;
+	y -= s->S * M;
+	z -= s->C * M;
+	b = x * x / M + y * y / M + z * z / M - s->D * s->D * M;
 	a = -x * k / M - y * l / M - z * m / M;
-	p = ((b = a * a / M - b) >= 0 ? (I(b * M, _, 0), b = E, a + (a > b ? -b : b)) : -1.0);
+	s->p = (b = a * a / M - b) >= 0 ? (b = I(b * M), a + (a > b ? -b : b)) : -1;
 }
 
-int o(int c, int x, int y, int z, int k, int l, int m, int a) {
-	Z = !c ? -1 : Z;
-	c < 44 ? (q(c, x, y, z, k, l, m, 0, 0), (p > 0 && c != a && (p < W || Z < 0)) ? (W = p, Z = c) : 0, o(c + 1, x, y, z, k, l, m, a)) : 0;
+void o(ray *s, int x, int y, int z, int k, int l, int m, int a) {
+	s->Z = -1;
+	for (int c = 0; c < 44; c++) {
+		q(s, c, x, y, z, k, l, m);
+		(s->p > 0 && c != a && (s->p < s->W || s->Z < 0)) ? (s->W = s->p, s->Z = c) : 0;
+	}
 }
 
-int n(int e, int f, int g, int h, int i, int j, int d, int a, int b, int V) {
-	o(0, e, f, g, h, i, j, a);
-	d > 0 && Z >= 0 ? (e += h * W / M, f += i * W / M, g += j * W / M, F(Z), u = e - E * M, v = f - S * M, w = g - C * M, b = (-2 * u - 2 * v + w) / 3, H(u * u + v * v + w * w), b /= D, b *= b, b *= 200, b /= (M * M), V = Z, E != 0 ? (u = -u * M / E, v = -v * M / E, w = -w * M / E) : 0, E = (h * u + i * v + j * w) / M, h -= u * E / (M / 2), i -= v * E / (M / 2), j -= w * E / (M / 2), n(e, f, g, h, i, j, d - 1, Z, 0, 0), Q /= 2, T /= 2, U /= 2, V = V < 22 ? 7 : (V < 30 ? 1 : (V < 38 ? 2 : (V < 44 ? 4 : (V == 44 ? 6 : 3)))), Q += V & 1 ? b : 0, T += V & 2 ? b : 0, U += V & 4 ? b : 0) : (d == P ? (g += 2, j = g > 0 ? g / 8 : g / 20) : 0, j > 0 ? (U = j * j / M, Q = 255 - 250 * U / M, T = 255 - 150 * U / M, U = 255 - 100 * U / M) : (U = j * j / M, U < M / 5 ? (Q = 255 - 210 * U / M, T = 255 - 435 * U / M, U = 255 - 720 * U / M) : (U -= M / 5, Q = 213 - 110 * U / M, T = 168 - 113 * U / M, U = 111 - 85 * U / M)), d != P ? (Q /= 2, T /= 2, U /= 2) : 0);
-	Q = Q < 0 ? 0 : Q > O ? O : Q;
-	T = T < 0 ? 0 : T > O ? O : T;
-	U = U < 0 ? 0 : U > O ? O : U;
-}
+void n(ray *s, int e, int f, int g, int h, int i, int j, int d, int a, int b, int V) {
+	int u, v, w;
 
-int t(int x, int y, int a, int b) {
-	n(M * J + M * 40 * (A * x + a) / X / A - M * 20, M * K, M * L - M * 30 * (A * y + b) / Y / A + M * 15, 0, M, 0, P, -1, 0, 0);
-	R += Q;
-	G += T;
-	B += U;
-	++a < A ? t(x, y, a, b) : (++b < A ? t(x, y, 0, b) : 0);
+	o(s, e, f, g, h, i, j, a);
+	d > 0 && s->Z >= 0 ? (e += h * s->W / M, f += i * s->W / M, g += j * s->W / M, F(s, s->Z), u = e - s->E * M, v = f - s->S * M, w = g - s->C * M, b = (-2 * u - 2 * v + w) / 3, s->E = I(u * u + v * v + w * w), b /= s->D, b *= b, b *= 200, b /= (M * M), V = s->Z, s->E != 0 ? (u = -u * M / s->E, v = -v * M / s->E, w = -w * M / s->E) : 0, s->E = (h * u + i * v + j * w) / M, h -= u * s->E / (M / 2), i -= v * s->E / (M / 2), j -= w * s->E / (M / 2), n(s, e, f, g, h, i, j, d - 1, s->Z, 0, 0), s->Q /= 2, s->T /= 2, s->U /= 2, V = V < 22 ? 7 : (V < 30 ? 1 : (V < 38 ? 2 : (V < 44 ? 4 : (V == 44 ? 6 : 3)))), s->Q += V & 1 ? b : 0, s->T += V & 2 ? b : 0, s->U += V & 4 ? b : 0) : (d == P ? (g += 2, j = g > 0 ? g / 8 : g / 20) : 0, j > 0 ? (s->U = j * j / M, s->Q = 255 - 250 * s->U / M, s->T = 255 - 150 * s->U / M, s->U = 255 - 100 * s->U / M) : (s->U = j * j / M, s->U < M / 5 ? (s->Q = 255 - 210 * s->U / M, s->T = 255 - 435 * s->U / M, s->U = 255 - 720 * s->U / M) : (s->U -= M / 5, s->Q = 213 - 110 * s->U / M, s->T = 168 - 113 * s->U / M, s->U = 111 - 85 * s->U / M)), d != P ? (s->Q /= 2, s->T /= 2, s->U /= 2) : 0);
+	s->Q = s->Q < 0 ? 0 : s->Q > O ? O : s->Q;
+	s->T = s->T < 0 ? 0 : s->T > O ? O : s->T;
+	s->U = s->U < 0 ? 0 : s->U > O ? O : s->U;
 }
 
-int r(int x, int y) {
-	R = G = B = 0;
-	t(x, y, 0, 0);
+void r(int x, int y) {
+	ray s = {0};
+	int R = 0, G = 0, B = 0;
+
+	for (int b = 0; b < A; b++)
+		for (int a = 0; a < A; a++) {
+			n(&s, M * J + M * 40 * (A * x + a) / X / A - M * 20, M * K, M * L - M * 30 * (A * y + b) / Y / A + M * 15, 0, M, 0, P, -1, 0, 0);
+			R += s.Q;
+			G += s.T;
+			B += s.U;
+		}
 
+	int offset = (y * X + x) * (BPP / 8);
 	frame_buffer[offset++] = B / A / A; // dump the pixel values straight to video RAM
 	frame_buffer[offset++] = G / A / A;
 	frame_buffer[offset++] = R / A / A;
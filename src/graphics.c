@@ -1,28 +1,22 @@
 /* Simple graphics test */
 
 // gcc -c -m64 -nostdlib -nostartfiles -nodefaultlibs -o graphics.o graphics.c
-// ld -T c.ld -o graphics.app graphics.o
+// ld -T c.ld -o graphics.app crt0.o graphics.o libBareMetal.o
 
 #include <stdint.h>
+#define size_t uint64_t
+#include "utils/fb.h"
 
-void putpixel(int x, int y, char red, char green, char blue);
 void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue);
 
-unsigned char *frame_buffer;
-uint16_t x_res, y_res;
-uint8_t depth;
-
 int main(void)
 {
-	// Gather video memory address, x & y resolution, and BPP
-	frame_buffer = (unsigned char *)(*(uint64_t *)(0x5080));
-	x_res = *(uint16_t *)(0x5088);
-	y_res = *(uint16_t *)(0x508A);
-	depth = 32;
+	fb_init(2);
+	fb_grab(); // the lines go on top of what's on the screen
 
 	//draw a line
-	drawline(0, 0, x_res - 1, y_res - 1, 0xFF, 0xFF, 0xFF);
-	drawline(0, y_res - 1, x_res - 1, 0, 0xFF, 0xFF, 0xFF);
+	drawline(0, 0, fb.width - 1, fb.height - 1, 0xFF, 0xFF, 0xFF);
+	drawline(0, fb.height - 1, fb.width - 1, 0, 0xFF, 0xFF, 0xFF);
 
 	// draw a square
 	drawline(100, 100, 100, 200, 0xFF, 0xFF, 0xFF);
@@ -30,20 +24,15 @@ int main(void)
 	drawline(200, 200, 200, 100, 0xFF, 0xFF, 0xFF);
 	drawline(200, 100, 100, 100, 0xFF, 0xFF, 0xFF);
 
-}
-
-void putpixel(int x, int y, char red, char green, char blue)
-{
-	int offset = ((y * x_res) + x) * (depth / 8);
-	frame_buffer[offset+0] = blue;
-	frame_buffer[offset+1] = green;
-	frame_buffer[offset+2] = red;
+	fb_mark(0, 0, fb.width, fb.height);
+	fb_present();
 }
 
 void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue)
 {
 	// Shamelessly adapted from https://stackoverflow.com/questions/10060046/drawing-lines-with-bresenhams-line-algorithm
 	int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
+	uint32_t color = fb_rgb(red, green, blue);
 	dx = x1 - x0;
 	dy = y1 - y0;
 	dx1 = dx;
@@ -68,7 +57,7 @@ void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue)
 			y = y1;
 			xe = x0;
 		}
-		putpixel(x, y, red, green, blue);
+		fb_putpixel(x, y, color);
 		for(i=0; x<xe; i++)
 		{
 			x = x + 1;
@@ -88,7 +77,7 @@ void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue)
 				}
 				px = px + 2 * (dy1 - dx1);
 			}
-			putpixel(x, y, red, green, blue);
+			fb_putpixel(x, y, color);
 		}
 	}
 	else
@@ -105,7 +94,7 @@ void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue)
 			y = y1;
 			ye = y0;
 		}
-		putpixel(x, y, red, green, blue);
+		fb_putpixel(x, y, color);
 		for(i=0; y<ye; i++)
 		{
 			y = y + 1;
@@ -125,7 +114,7 @@ void drawline(int x0, int y0, int x1, int y1, char red, char green, char blue)
 				}
 				py = py + 2 * (dx1 - dy1);
 			}
-			putpixel(x, y, red, green, blue);
+			fb_putpixel(x, y, color);
 		}
 	}
 }
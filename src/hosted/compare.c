@@ -0,0 +1,82 @@
+// Compares two PPM images for check.sh: prints the PSNR, the largest
+// difference of a color channel and the largest mean difference of the
+// channels of an 8x8 pixel block. Fails when the PSNR is below the given
+// minimum or either difference above its maximum. The block difference
+// catches a cluster of wrong pixels, which costs the PSNR of a whole image
+// little but stands out from differences in rounding spread over it.
+//
+// compare reference.ppm image.ppm [min PSNR in dB] [max difference] [max block difference]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COMPARE_BLOCK 8
+
+static unsigned char *compare_read(const char *file, int *width, int *height) {
+	FILE *f = fopen(file, "rb");
+	int max;
+
+	if (!f || fscanf(f, "P6 %d %d %d", width, height, &max) != 3 || max != 255 || fgetc(f) == EOF) {
+		fprintf(stderr, "compare: can't read %s\n", file);
+		exit(2);
+	}
+
+	size_t size = (size_t)*width * *height * 3;
+	unsigned char *pixels = malloc(size);
+	if (!pixels || fread(pixels, 1, size, f) != size) {
+		fprintf(stderr, "compare: %s is too short\n", file);
+		exit(2);
+	}
+	fclose(f);
+	return pixels;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "compare reference.ppm image.ppm [min PSNR] [max difference] [max block difference]\n");
+		return 2;
+	}
+
+	double minPsnr = argc > 3 ? atof(argv[3]) : 0;
+	int maxDifference = argc > 4 ? atoi(argv[4]) : 255;
+	double maxBlock = argc > 5 ? atof(argv[5]) : 255;
+	int width, height, referenceWidth, referenceHeight;
+	unsigned char *reference = compare_read(argv[1], &referenceWidth, &referenceHeight);
+	unsigned char *image = compare_read(argv[2], &width, &height);
+
+	if (width != referenceWidth || height != referenceHeight) {
+		printf("size %d x %d, reference %d x %d\n", width, height, referenceWidth, referenceHeight);
+		return 1;
+	}
+
+	double error = 0;
+	int largest = 0;
+	for (size_t i = 0; i < (size_t)width * height * 3; i++) {
+		int d = abs(image[i] - reference[i]);
+		error += d * d;
+		if (d > largest)
+			largest = d;
+	}
+
+	// Blocks at the right and bottom edges are averaged over the pixels they have
+	double block = 0;
+	for (int by = 0; by < height; by += COMPARE_BLOCK)
+		for (int bx = 0; bx < width; bx += COMPARE_BLOCK) {
+			int sum = 0, pixels = 0;
+			for (int y = by; y < by + COMPARE_BLOCK && y < height; y++)
+				for (int x = bx; x < bx + COMPARE_BLOCK && x < width; x++, pixels++)
+					for (int c = 0; c < 3; c++) {
+						size_t i = ((size_t)y * width + x) * 3 + c;
+						sum += abs(image[i] - reference[i]);
+					}
+			if ((double)sum / (pixels * 3) > block)
+				block = (double)sum / (pixels * 3);
+		}
+
+	error /= (double)width * height * 3;
+	double psnr = error ? 10 * log10(255 * 255 / error) : INFINITY;
+	printf("PSNR %.2f dB, max difference %d, block %.1f\n", psnr, largest, block);
+
+	return psnr < minPsnr || largest > maxDifference || block > maxBlock;
+}
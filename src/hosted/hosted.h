@@ -0,0 +1,17 @@
+#ifndef __HOSTED_H__
+#define __HOSTED_H__
+
+#include <stdint.h>
+
+// Included ahead of every demo in the hosted build (gcc -include, see
+// build.sh): moves the memory the demos expect at fixed addresses into memory
+// of the hosted process, see libBareMetal.c here.
+
+extern unsigned char *hosted_memory;
+extern uint8_t hosted_cpuTable[256];
+
+#define SMP_CPU_TABLE ((uintptr_t)hosted_cpuTable)
+#define FB_MEMORY ((uintptr_t)hosted_memory)
+#define ACCUM_MEMORY ((uintptr_t)hosted_memory)
+
+#endif
@@ -0,0 +1,319 @@
+// The BareMetal API for running the C demos as Linux programs, to profile and
+// benchmark them on a development machine (./build.sh hosted, see bench.sh).
+// The demos are built from the same sources, with hosted.h moving the memory
+// they expect at fixed addresses.
+//
+// - The cores are threads: the calling thread is the BSP (ID 0), the APs
+//   wait for work from SMP_SET.
+// - The screen is a buffer in memory, written to a PPM file by the dump
+//   command of HOSTED_INPUT.
+// - The kernel calls the demos make directly (call *0x00100048 for a delay)
+//   go through a trampoline placed at the same address.
+//
+// Settings come from the environment:
+//
+//	HOSTED_WIDTH, HOSTED_HEIGHT  size of the screen, 1024 x 768 by default
+//	HOSTED_CORES                 number of cores, the CPUs of the machine by default
+//	HOSTED_INPUT                 what b_input returns, "space 100" by default
+//
+// HOSTED_INPUT is a list of commands separated by spaces:
+//
+//	c            the key c, or space for the space bar
+//	n            no key n times, which in the main loop of a demo is n frames
+//	dump=file    writes the screen to a PPM file once the APs are idle
+//
+// Once the list is done, b_input returns q. The time of every key and every
+// run of frames, up to the next call of b_input, is printed to stderr.
+
+#define _GNU_SOURCE
+#include <cpuid.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../libBareMetal.h"
+
+#define HOSTED_MAX_CORES 256
+#define HOSTED_MEMORY_SIZE (1ull << 30)
+#define HOSTED_MAX_COMMANDS 256
+
+unsigned char *hosted_memory;
+uint8_t hosted_cpuTable[HOSTED_MAX_CORES];
+uint64_t hosted_stateSize = 512;   // bytes the trampoline saves the vector registers in
+uint8_t hosted_xsave;              // with xsave rather than fxsave
+
+static uint32_t width = 1024, height = 768, cores;
+static uint32_t *screen;
+static double startTime;
+
+static __thread uint32_t self; // SMP ID of the calling thread
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	void (*job)(void);
+	int busy;
+} hostedCore;
+
+static hostedCore core[HOSTED_MAX_CORES];
+
+static char *commands[HOSTED_MAX_COMMANDS];
+static uint32_t commandCount, nextCommand;
+static const char *running;     // command being timed
+static uint64_t framesLeft, frames;
+static double runningStart;
+
+static double hosted_ms() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+// The kernel calls made by the demos, function in rcx and value in rax. Only
+// the delay (6, microseconds) is needed.
+void hosted_kernelCall(uint64_t function, uint64_t value) {
+	if (function == 6) {
+		struct timespec t = {value / 1000000, value % 1000000 * 1000};
+		nanosleep(&t, 0);
+	}
+}
+
+// The kernel preserves every register, so the trampoline saves the ones C
+// code may change around the call to hosted_kernelCall. The vector registers
+// go whole, the upper halves of the ymm registers of the avx2 builds too,
+// with xsave where the OS enables it and else with fxsave.
+asm (
+	".text\n"
+	"hosted_trampoline:\n\t"
+	"push %rbp\n\t"
+	"mov %rsp, %rbp\n\t"
+	"push %rax\n\tpush %rcx\n\tpush %rdx\n\tpush %rsi\n\tpush %rdi\n\t"
+	"push %r8\n\tpush %r9\n\tpush %r10\n\tpush %r11\n\t"
+	"mov %rcx, %rdi\n\t"
+	"mov %rax, %rsi\n\t"
+	"and $-64, %rsp\n\t"
+	"sub hosted_stateSize(%rip), %rsp\n\t"
+	"cmpb $0, hosted_xsave(%rip)\n\t"
+	"je 1f\n\t"
+	"movq $0, 512(%rsp)\n\tmovq $0, 520(%rsp)\n\tmovq $0, 528(%rsp)\n\tmovq $0, 536(%rsp)\n\t"
+	"movq $0, 544(%rsp)\n\tmovq $0, 552(%rsp)\n\tmovq $0, 560(%rsp)\n\tmovq $0, 568(%rsp)\n\t"
+	"mov $-1, %eax\n\t"
+	"mov $-1, %edx\n\t"
+	"xsave (%rsp)\n\t"
+	"jmp 2f\n"
+	"1:\tfxsave (%rsp)\n"
+	"2:\tcall hosted_kernelCall\n\t"
+	"cmpb $0, hosted_xsave(%rip)\n\t"
+	"je 3f\n\t"
+	"mov $-1, %eax\n\t"
+	"mov $-1, %edx\n\t"
+	"xrstor (%rsp)\n\t"
+	"jmp 4f\n"
+	"3:\tfxrstor (%rsp)\n"
+	"4:\tlea -72(%rbp), %rsp\n\t"
+	"pop %r11\n\tpop %r10\n\tpop %r9\n\tpop %r8\n\t"
+	"pop %rdi\n\tpop %rsi\n\tpop %rdx\n\tpop %rcx\n\tpop %rax\n\t"
+	"pop %rbp\n\t"
+	"ret\n"
+);
+
+void hosted_trampoline(void);
+
+static void *hosted_core(void *arg) {
+	hostedCore *c = arg;
+	self = c - core;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->job)
+			pthread_cond_wait(&c->wake, &c->lock);
+		void (*job)(void) = c->job;
+		pthread_mutex_unlock(&c->lock);
+
+		job();
+
+		pthread_mutex_lock(&c->lock);
+		c->job = 0;
+		__atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&c->wake); // for SMP_SET waiting on this core
+	}
+	return 0;
+}
+
+static int hosted_busy() {
+	for (uint32_t i = 0; i < cores; i++)
+		if (i != self && __atomic_load_n(&core[i].busy, __ATOMIC_ACQUIRE))
+			return 1;
+	return 0;
+}
+
+static void hosted_dump(const char *file) {
+	while (hosted_busy())
+		sched_yield();
+
+	FILE *f = fopen(file, "wb");
+	if (!f) {
+		fprintf(stderr, "hosted: can't write %s\n", file);
+		return;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", width, height);
+	for (uint64_t i = 0; i < (uint64_t)width * height; i++) {
+		unsigned char rgb[3] = {screen[i] >> 16, screen[i] >> 8, screen[i]};
+		fwrite(rgb, 3, 1, f);
+	}
+	fclose(f);
+}
+
+// Prints the time of the command that ran since the last call
+static void hosted_report(double now) {
+	if (!running)
+		return;
+
+	fflush(stdout);
+	if (frames)
+		fprintf(stderr, "hosted: %lu frames, %.3f ms/frame\n", frames, (now - runningStart) / frames);
+	else
+		fprintf(stderr, "hosted: key %s, %.3f ms\n", running, now - runningStart);
+	running = 0;
+}
+
+static void hosted_exit() {
+	double now = hosted_ms();
+
+	hosted_report(now);
+	while (nextCommand < commandCount)
+		if (!strncmp(commands[nextCommand++], "dump=", 5))
+			hosted_dump(commands[nextCommand - 1] + 5);
+
+	fflush(stdout);
+	fprintf(stderr, "hosted: %.3f ms in total\n", now - startTime);
+}
+
+__attribute__((constructor)) static void hosted_init() {
+	char *s;
+
+	if ((s = getenv("HOSTED_WIDTH")))
+		width = atoi(s);
+	if ((s = getenv("HOSTED_HEIGHT")))
+		height = atoi(s);
+	cores = (s = getenv("HOSTED_CORES")) ? atoi(s) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+	if (cores > HOSTED_MAX_CORES)
+		cores = HOSTED_MAX_CORES;
+
+	static char input[4096];
+	strncpy(input, (s = getenv("HOSTED_INPUT")) ? s : "space 100", sizeof(input) - 1);
+	for (char *c = strtok(input, " "); c && commandCount < HOSTED_MAX_COMMANDS; c = strtok(0, " "))
+		commands[commandCount++] = c;
+
+	screen = calloc((uint64_t)width * height, 4);
+	hosted_memory = mmap(0, HOSTED_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	unsigned char *kernel = mmap((void *)0x100000, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (!screen || hosted_memory == MAP_FAILED || kernel != (unsigned char *)0x100000) {
+		fprintf(stderr, "hosted: out of memory\n");
+		exit(1);
+	}
+	*(uint64_t *)(kernel + 0x48) = (uint64_t)hosted_trampoline;
+
+	// The size of the xsave area for the features the OS enables
+	unsigned int a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) && __get_cpuid_count(0xD, 0, &a, &b, &c, &d)) {
+		hosted_stateSize = (b + 63) & ~63u;
+		hosted_xsave = 1;
+	}
+
+	for (uint32_t i = 0; i < cores; i++) {
+		hosted_cpuTable[i] = i;
+		pthread_mutex_init(&core[i].lock, 0);
+		pthread_cond_init(&core[i].wake, 0);
+		pthread_t thread;
+		if (i && pthread_create(&thread, 0, hosted_core, &core[i]) == 0)
+			pthread_detach(thread);
+	}
+
+	startTime = hosted_ms();
+	atexit(hosted_exit);
+}
+
+u8 b_input(void) {
+	double now = hosted_ms();
+
+	for (;;) {
+		if (framesLeft) {
+			framesLeft--;
+			return 0;
+		}
+
+		hosted_report(now);
+		if (nextCommand == commandCount)
+			return 'q';
+
+		const char *c = commands[nextCommand++];
+		if (!strncmp(c, "dump=", 5)) {
+			hosted_dump(c + 5);
+			continue;
+		}
+
+		running = c;
+		runningStart = now;
+		frames = 0;
+		if (c[0] >= '0' && c[0] <= '9') {
+			frames = framesLeft = strtoull(c, 0, 10);
+			continue;
+		}
+		return strcmp(c, "space") ? c[0] : ' ';
+	}
+}
+
+void b_output(const char *str, u64 nbr) {
+	fwrite(str, 1, nbr, stdout);
+}
+
+u64 b_system(u64 function, u64 var1, u64 var2) {
+	uint32_t lo, hi;
+
+	switch (function) {
+	case SMP_ID:
+		return self;
+	case SMP_NUMCORES:
+		return cores;
+	case SMP_SET:
+		if (var2 >= cores || var2 == self)
+			return 0;
+		pthread_mutex_lock(&core[var2].lock);
+		while (core[var2].job)
+			pthread_cond_wait(&core[var2].wake, &core[var2].lock);
+		core[var2].job = (void (*)(void))var1;
+		__atomic_store_n(&core[var2].busy, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&core[var2].wake);
+		pthread_mutex_unlock(&core[var2].lock);
+		return 1;
+	case SMP_BUSY:
+		return hosted_busy();
+	case TSC:
+		asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+		return (uint64_t)hi << 32 | lo;
+	case SCREEN_LFB_GET:
+		return (uint64_t)screen;
+	case SCREEN_X_GET:
+		return width;
+	case SCREEN_Y_GET:
+		return height;
+#ifdef SCREEN_PPSL_GET
+	case SCREEN_PPSL_GET:
+		return width;
+#endif
+#ifdef SCREEN_BPP_GET
+	case SCREEN_BPP_GET:
+		return 32;
+#endif
+	}
+	return 0;
+}
@@ -6,83 +6,97 @@ Based on Andrew Kensler's business card sized ray tracer
 Breakdown by Fabien Sanglard here: https://fabiensanglard.net/rayTracing_back_of_business_card/
 
 - Converted from C++ to C
-- Uses built-in functions for pow, sqrt, ceil, and rand
+- Uses utils/math for pow, sqrt and ceil, and utils/rand for random numbers
 
 Upon execution it will render the image directly to the screen
 The first run will use only one CPU core
 The second run will use all available CPU cores
 
-*/
+The image is split into TILE x TILE tiles. Each core starts with a contiguous
+run of tiles in its own deque and takes from the front; once it runs dry it
+steals single tiles from the back of the other cores' deques so every core
+stays busy until the last tile is done. The cores are started once per render
+and go through the passes together, meeting at a barrier after each one.
 
-#include "libBareMetal.h"
+The cores are picked in the order of utils/topology.h, cores of their own
+before SMT siblings, and the deques are numbered in that order, so the cores
+of a package start on neighbouring runs of tiles. A core steals from the
+cores of its own package before going to another one.
 
-#define R1 1103515245
-#define R2 12345
-#define R3 2147483648 // 2^31
-#define RAND_MAX 32767
+Build with -DPACKET=4 (SSE) or -DPACKET=8 (AVX2, needs -mavx2) to trace the
+primary rays of each pixel in packets against the precomputed sphere list.
+Secondary and shadow rays still go through the scalar T().
 
-typedef int i;
-typedef float f;
-u8 *frame_buffer;
-u32 *cpu_table;
-u16 X, Y;
-u32 progress = 0;
-u64 next = 1; // For rand()
-u64 lock = 0, TOTALCORES = 0, BSP;
-
-// Custom pow
-double bpow(double x, double y) {
-	double result = 1.0;
-	i neg_exp_flag = 0;
-
-	if (y < 0) {
-		neg_exp_flag = 1;
-		y = -y;
-	}
+The spheres are decoded from G[] once at startup and put in a small bounding
+volume hierarchy that both tracers walk, so a ray only tests the spheres
+whose boxes it actually passes through.
 
-	for (i c=0; c < y; c++)
-		result *= x;
+Rendering is progressive: every pass adds samples to each pixel in a float
+accumulation buffer and writes the running average to the screen, starting
+with a single sample per pixel so a preview shows up right away. The sample
+count doubles each pass up to 64 per pixel. Once a pixel has MINSAMPLES
+samples it is left alone as soon as the standard error of its brightness
+drops below NOISE, which skips most of the work in the sky and on the floor.
 
-	if (neg_exp_flag)
-		result = 1.0 / result;
+*/
 
-	return result;
-}
+#include "libBareMetal.h"
+#include "utils/math/math.h"
+#include "utils/rand.h"
+#include "utils/perf.h"
+#include "utils/smp.h"
 
-// Custom sqrt
-double bsqrt(double num) {
-	if (num < 0)
-		return -1;
+#define TILE 32 // Tile width and height in pixels
+#define MAXCORES 256
+#define PASSES 7 // Progressive passes, see samples[]
+#define MINSAMPLES 8 // Samples a pixel needs before it may stop early
+#define NOISE .5 // Stop once the standard error is below this many 8-bit levels
 
-	double e = 0.00001;
-	double guess = num / 2.0;
+#ifndef ACCUM_MEMORY
+#define ACCUM_MEMORY 0xFFFF800001000000 // Accumulation buffer, 16MiB into the app memory
+#endif
 
-	while (1) {
-		double new_guess = 0.5 * (guess + num / guess);
+typedef int i;
+typedef float f;
+u8 *frame_buffer;
+u16 X, Y;
+u64 TOTALCORES = 0, BSP;
+u32 tiles_x, tiles_y, tiles;
+u8 slotOf[256]; // Deque slot of every APIC ID
+u8 slotPackage[MAXCORES]; // Package of the core of every slot
+smp_barrier passDone; // Every core is done with the pass
+u32 pass; // Current progressive pass
+u32 samples[PASSES] = {1, 1, 2, 4, 8, 16, 32}; // Samples per pixel added in each pass
+
+// Per-pixel sums for progressive rendering
+typedef struct {
+	f r, g, b; // Sum of the sample colors
+	f l, l2; // Sum of the sample brightness and of its square
+	u32 n; // Samples taken so far
+} acc;
 
-		if (guess - new_guess < e && guess - new_guess > -e)
-			break;
+acc *accum;
 
-		guess = new_guess;
-	}
+// Per-core tile deque. The remaining range is [head, tail) packed into one
+// 64-bit word (head in the low half, tail in the high half) so the owner and
+// thieves can both update it with a single compare-and-swap.
+// Padded to a cache line so cores don't false-share each others deque.
+typedef struct {
+	u64 range;
+	u64 pad[7];
+} deque;
 
-	return guess;
-}
+deque queue[MAXCORES] __attribute__((aligned(64)));
 
-// Custom ceil
-double bceil(double num) {
-	double part = (i)num;
-	if (num > part)
-		return part + 1;
-	else
-		return part;
-}
+// Per-core random number state, indexed by APIC ID and padded to a cache line.
+// It is reseeded from the tile number at the start of every tile, so the
+// image does not depend on which core rendered which tile.
+typedef struct {
+	rand_state s; // Scalar stream for the light jitter in shade()
+	rand_state4 v; // SIMD stream for the primary ray jitter in pixel()
+} __attribute__((aligned(64))) rng;
 
-// Custom rand
-uint64_t rand() {
-	next = (R1 * next + R2) % R3;
-	return next % (RAND_MAX + 1);
-}
+rng core_rng[MAXCORES];
 
 // Vector Structure
 typedef struct {
@@ -114,7 +128,7 @@ vector v_cross(vector a, vector b) {
 
 // Vector Normalize
 vector v_norm(vector a) {
-	f mag = bsqrt(v_dot(a, a));
+	f mag = sqrt(v_dot(a, a));
 	return v_mul(a, 1 / mag);
 }
 
@@ -127,9 +141,92 @@ vector v_init(f a, f b, f c) {
 // Array of spheres (displaying 'Hi!')
 i G[] = {280336, 279040, 279040, 279056, 509456, 278544, 278544, 279056, 278544};
 
-// Random generator, return a float within range [0-1]
-f R() {
-	return (f)rand() / RAND_MAX;
+// Sphere centers decoded from G[] once at startup
+vector sphere[9 * 19];
+i spheres = 0;
+
+// Bounding volume hierarchy over sphere[]
+// Leaves hold spheres [first, first + count), inner nodes have count 0
+typedef struct {
+	vector lo, hi;
+	i first, count, left, right;
+} node;
+
+#define LEAF 4 // Maximum spheres per leaf
+
+node bvh[2 * 9 * 19];
+i nodes = 0;
+
+// Build the subtree for spheres [first, first + count) and return its node
+i build(i first, i count) {
+	node *b = &bvh[nodes];
+	i n = nodes++;
+
+	b->lo = b->hi = sphere[first];
+	for (i k = first; k < first + count; k++) {
+		vector c = sphere[k];
+		if (c.x < b->lo.x) b->lo.x = c.x;
+		if (c.y < b->lo.y) b->lo.y = c.y;
+		if (c.z < b->lo.z) b->lo.z = c.z;
+		if (c.x > b->hi.x) b->hi.x = c.x;
+		if (c.y > b->hi.y) b->hi.y = c.y;
+		if (c.z > b->hi.z) b->hi.z = c.z;
+	}
+	b->lo = v_add(b->lo, v_init(-1, -1, -1)); // Spheres have a radius of 1
+	b->hi = v_add(b->hi, v_init(1, 1, 1));
+	b->first = first;
+	b->count = count;
+
+	if (count <= LEAF)
+		return n;
+
+	// Split at the median along the longest axis (insertion sort, the lists are tiny)
+	vector e = v_add(b->hi, v_mul(b->lo, -1));
+	i axis = e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+	for (i k = first + 1; k < first + count; k++) {
+		vector c = sphere[k];
+		i j = k;
+		for (; j > first && ((f *)&sphere[j - 1])[axis] > ((f *)&c)[axis]; j--)
+			sphere[j] = sphere[j - 1];
+		sphere[j] = c;
+	}
+
+	b->count = 0;
+	b->left = build(first, count / 2);
+	b->right = build(first + count / 2, count - count / 2);
+	return n;
+}
+
+void init_spheres() {
+	spheres = 0;
+	for (i k = 19; k--;)
+		for (i j = 9; j--;)
+			if (G[j] & 1 << k)
+				sphere[spheres++] = v_init(k, 0, j + 4);
+	nodes = 0;
+	if (spheres)
+		build(0, spheres);
+}
+
+// Slab test of a ray (origin o, inverse direction v) against a node's box
+// Return 1 if the box is hit closer than t
+i box(vector o, vector v, node *b, f t) {
+	f x0 = (b->lo.x - o.x) * v.x, x1 = (b->hi.x - o.x) * v.x;
+	f y0 = (b->lo.y - o.y) * v.y, y1 = (b->hi.y - o.y) * v.y;
+	f z0 = (b->lo.z - o.z) * v.z, z1 = (b->hi.z - o.z) * v.z;
+	f near = x0 < x1 ? x0 : x1, far = x0 < x1 ? x1 : x0;
+	f n = y0 < y1 ? y0 : y1, m = y0 < y1 ? y1 : y0;
+	if (n > near) near = n;
+	if (m < far) far = m;
+	n = z0 < z1 ? z0 : z1, m = z0 < z1 ? z1 : z0;
+	if (n > near) near = n;
+	if (m < far) far = m;
+	return near <= far && far > .01 && near < t;
+}
+
+// Random generator, return a float within range [0-1)
+f R(rng *g) {
+	return rand_float(&g->s);
 }
 
 // Tracer
@@ -146,79 +243,335 @@ i T(vector o, vector d, f *t, vector *n) {
 		m = 1;
 	}
 
-	for (i k = 19; k--;)
-		for (i j = 9; j--;)
-			if (G[j] & 1 << k) {
-				vector p = v_add(o, v_init(-k, 0, -j - 4));
-				f b = v_dot(p, d), c = v_dot(p, p) - 1, q = b * b - c;
-				if (q > 0) {
-					f s = -b - bsqrt(q);
-					if (s < *t && s > .01) {
-						*t = s;
-						*n = v_norm(v_add(p, v_mul(d, *t)));
-						m = 2;
-					}
+	// Walk the BVH, skipping every node whose box is missed or further away than the closest hit
+	vector v = v_init(1 / d.x, 1 / d.y, 1 / d.z);
+	i stack[64], top = 0, hit = -1;
+	if (nodes)
+		stack[top++] = 0;
+	while (top) {
+		node *b = &bvh[stack[--top]];
+		if (!box(o, v, b, *t))
+			continue;
+		if (!b->count) {
+			stack[top++] = b->right;
+			stack[top++] = b->left;
+			continue;
+		}
+		for (i k = b->first; k < b->first + b->count; k++) {
+			vector p = v_add(o, v_mul(sphere[k], -1));
+			f b = v_dot(p, d), c = v_dot(p, p) - 1, q = b * b - c;
+			if (q > 0) {
+				f s = -b - sqrt(q);
+				if (s < *t && s > .01) {
+					*t = s;
+					hit = k;
 				}
 			}
+		}
+	}
+
+	if (hit >= 0) {
+		*n = v_norm(v_add(v_add(o, v_mul(sphere[hit], -1)), v_mul(d, *t)));
+		m = 2;
+	}
 
 	return m;
 }
 
+// Shader
+// Return the pixel color for a ray from o in direction d whose trace result
+// (m, t and n as returned by T) is already known
+vector shade(vector o, vector d, i m, f t, vector n, rng *g);
+
 // Sampler
 // Return the pixel color for a ray passing by point o (origin) and d (direction)
-vector S(vector o, vector d) {
+vector S(vector o, vector d, rng *g) {
 	f t;
 	vector n;
 	i m = T(o, d, &t, &n);
+	return shade(o, d, m, t, n, g);
+}
 
+vector shade(vector o, vector d, i m, f t, vector n, rng *g) {
 	// Generate a sky color if no sphere is hit and the ray goes up
 	if (!m)
-		return v_mul(v_init(.7, .6, 1), bpow(1 - d.z, 4));
+		return v_mul(v_init(.7, .6, 1), pow(1 - d.z, 4));
 
 	vector h = v_add(o, v_mul(d, t));
-	vector l = v_norm(v_add(v_init(9 + R(), 9 + R(), 16), v_mul(h, -1)));
+	vector l = v_norm(v_add(v_init(9 + R(g), 9 + R(g), 16), v_mul(h, -1)));
 	vector r = v_add(d, v_mul(n, v_dot(n, d) * -2));
 	f b = v_dot(l, n);
 	if (b < 0 || T(h, l, &t, &n))
 		b = 0;
 
-	f p = bpow(v_dot(l, r) * (b > 0), 99);
+	f p = pow(v_dot(l, r) * (b > 0), 99);
 
 	// Generate a floor color if no sphere is hit and the ray goes down
 	if (m & 1) {
 		h = v_mul(h, .2);
-		return v_mul(((i)(bceil(h.x) + bceil(h.y)) & 1) ? v_init(3, 1, 1) : v_init(3, 3, 3), b * .2 + .1);
+		return v_mul(((i)(ceil(h.x) + ceil(h.y)) & 1) ? v_init(3, 1, 1) : v_init(3, 3, 3), b * .2 + .1);
 	}
 
 	// A sphere was hit.
-	return v_add(v_init(p, p, p), v_mul(S(h, r), .5));
+	return v_add(v_init(p, p, p), v_mul(S(h, r, g), .5));
+}
+
+// Add a sample color to a pixel's sums
+void add_sample(acc *q, vector c) {
+	f l = (c.x + c.y + c.z) * (1 / 3.);
+	q->r += c.x;
+	q->g += c.y;
+	q->b += c.z;
+	q->l += l;
+	q->l2 += l * l;
+	q->n++;
+}
+
+#ifdef PACKET
+// A packet of PACKET floats or ints, one lane per ray
+typedef f vf __attribute__((vector_size(PACKET * 4)));
+typedef i vi __attribute__((vector_size(PACKET * 4)));
+
+#if PACKET == 8
+#define vsqrt sqrt8
+#else
+#define vsqrt sqrt4
+#endif
+
+// Per lane select, a where m is set and b elsewhere
+static inline vf vsel(vi m, vf a, vf b) {
+	return (vf)((m & (vi)a) | (~m & (vi)b));
+}
+
+static inline vf vmin(vf a, vf b) {
+	return vsel(a < b, a, b);
+}
+
+static inline vf vmax(vf a, vf b) {
+	return vsel(a < b, b, a);
+}
+
+// Return 1 if any lane of m is set
+static inline i vany(vi m) {
+	i r = 0;
+	for (i l = 0; l < PACKET; l++)
+		r |= m[l];
+	return r;
 }
 
-int render()
+// Packet tracer
+// Same as T() for PACKET rays at once. Stores the hit type in m, the
+// distance in t and the index of the sphere that was hit in s per lane
+void T_packet(vf ox, vf oy, vf oz, vf dx, vf dy, vf dz, vi *m, vf *t, vi *s) {
+	vf zero = {0}, min = zero + .01f;
+	vf p = -oz / dz;
+	vi hit = min < p;
+	*t = vsel(hit, p, zero + 1e9f);
+	*m = hit & 1;
+	*s = (vi){0};
+
+	// Walk the BVH with the whole packet, descending while any lane hits the box
+	vf vx = 1 / dx, vy = 1 / dy, vz = 1 / dz;
+	i stack[64], top = 0;
+	if (nodes)
+		stack[top++] = 0;
+	while (top) {
+		node *n = &bvh[stack[--top]];
+		vf x0 = (n->lo.x - ox) * vx, x1 = (n->hi.x - ox) * vx;
+		vf y0 = (n->lo.y - oy) * vy, y1 = (n->hi.y - oy) * vy;
+		vf z0 = (n->lo.z - oz) * vz, z1 = (n->hi.z - oz) * vz;
+		vf near = vmax(vmax(vmin(x0, x1), vmin(y0, y1)), vmin(z0, z1));
+		vf far = vmin(vmin(vmax(x0, x1), vmax(y0, y1)), vmax(z0, z1));
+		if (!vany((near <= far) & (far > min) & (near < *t)))
+			continue;
+		if (!n->count) {
+			stack[top++] = n->right;
+			stack[top++] = n->left;
+			continue;
+		}
+		for (i k = n->first; k < n->first + n->count; k++) {
+			vf px = ox - sphere[k].x, py = oy - sphere[k].y, pz = oz - sphere[k].z;
+			vf b = px * dx + py * dy + pz * dz, c = px * px + py * py + pz * pz - 1, q = b * b - c;
+			hit = q > zero;
+			vf d = -b - vsqrt(vsel(hit, q, zero));
+			hit &= (d < *t) & (d > min);
+			*t = vsel(hit, d, *t);
+			*m = (hit & 2) | (~hit & *m);
+			*s = (hit & k) | (~hit & *s);
+		}
+	}
+}
+
+// Trace n samples for pixel x, y and add them to q
+void pixel(i x, i y, vector a, vector b, vector c, rng *g, i n, acc *q) {
+	vector o[PACKET], d[PACKET];
+	vf ox = {0}, oy = {0}, oz = {0}, dx = {0}, dy = {0}, dz = {0}, t;
+	vi m, s;
+	f j[64 * 4]; // Four random numbers per sample for the primary ray
+	rand_fill(&g->v, j, (n + PACKET - 1) / PACKET * PACKET * 4);
+
+	for (i r = 0; r < n; r += PACKET) {
+		for (i l = 0; l < PACKET; l++) {
+			f *k = &j[(r + l) * 4];
+			vector u = v_add(v_mul(a, (k[0] - .5) * 99), v_mul(b, (k[1] - .5) * 99));
+			o[l] = v_add(v_init(17, 16, 8), u);
+			d[l] = v_norm(v_add(v_mul(u, -1), v_mul(v_add(v_add(v_mul(a, k[2] + x), v_mul(b, y + k[3])), c), 16)));
+			ox[l] = o[l].x; oy[l] = o[l].y; oz[l] = o[l].z;
+			dx[l] = d[l].x; dy[l] = d[l].y; dz[l] = d[l].z;
+		}
+
+		T_packet(ox, oy, oz, dx, dy, dz, &m, &t, &s);
+
+		// Lanes past n only pad out the last packet of small passes
+		for (i l = 0; l < PACKET && r + l < n; l++) {
+			vector e = v_init(0, 0, 1);
+			if (m[l] == 2)
+				e = v_norm(v_add(v_add(o[l], v_mul(sphere[s[l]], -1)), v_mul(d[l], t[l])));
+			add_sample(q, shade(o[l], d[l], m[l], t[l], e, g));
+		}
+	}
+}
+#else
+// Trace n samples for pixel x, y and add them to q
+void pixel(i x, i y, vector a, vector b, vector c, rng *g, i n, acc *q) {
+	f j[64 * 4]; // Four random numbers per sample for the primary ray
+	rand_fill(&g->v, j, n * 4);
+	for (i r = n; r--;) {
+		f *k = &j[r * 4];
+		vector t = v_add(v_mul(a, (k[0] - .5) * 99), v_mul(b, (k[1] - .5) * 99));
+		add_sample(q, S(v_add(v_init(17, 16, 8), t), v_norm(v_add(v_mul(t, -1), v_mul(v_add(v_add(v_mul(a, k[2] + x), v_mul(b, y + k[3])), c), 16))), g));
+	}
+}
+#endif
+
+// Take a tile from the front of our own deque
+// Return the tile number, or -1 if the deque is empty
+i pop_tile(deque *q) {
+	u64 r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+	u32 head, tail;
+	do {
+		head = (u32)r;
+		tail = (u32)(r >> 32);
+		if (head >= tail)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&q->range, &r, ((u64)tail << 32) | (head + 1), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return head;
+}
+
+// Take a tile from the back of another core's deque
+// Return the tile number, or -1 if the deque is empty
+i steal_tile(deque *q) {
+	u64 r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+	u32 head, tail;
+	do {
+		head = (u32)r;
+		tail = (u32)(r >> 32);
+		if (head >= tail)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&q->range, &r, ((u64)(tail - 1) << 32) | head, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return tail - 1;
+}
+
+// Split the tiles evenly into the first 'cores' deques
+void init_tiles(u64 cores) {
+	tiles_x = (X + TILE - 1) / TILE;
+	tiles_y = (Y + TILE - 1) / TILE;
+	tiles = tiles_x * tiles_y;
+	for (u64 t = 0; t < MAXCORES; t++) {
+		u32 head = t < cores ? tiles * t / cores : 0;
+		u32 tail = t < cores ? tiles * (t + 1) / cores : 0;
+		queue[t].range = ((u64)tail << 32) | head;
+	}
+}
+
+// Returns the number of pixels traced
+u32 render_tile(u32 tile, vector a, vector b, vector c, rng *g) {
+	i x0 = (tile % tiles_x) * TILE, y0 = (tile / tiles_x) * TILE;
+	i x1 = x0 + TILE < X ? x0 + TILE : X, y1 = y0 + TILE < Y ? y0 + TILE : Y;
+
+	// Seed from the pass and tile so the result doesn't depend on the core
+	u64 seed = (u64)pass * tiles + tile;
+	rand_seed(&g->s, seed << 1);
+	rand_seed4(&g->v, seed << 1 | 1);
+	u32 traced = 0;
+
+	for (i y = y0; y < y1; y++)
+		for (i x = x0; x < x1; x++) {
+			acc *q = &accum[y * X + x];
+
+			// Leave the pixel alone if its brightness is already known well
+			// enough (variance of the mean, scaled to 8-bit levels)
+			if (q->n >= MINSAMPLES) {
+				f m = q->l / q->n;
+				if ((q->l2 / q->n - m * m) * (224 * 224) < NOISE * NOISE * q->n)
+					continue;
+			}
+
+			pixel(x, y, a, b, c, g, samples[pass], q);
+			traced++;
+
+			// Average of the samples so far, scaled like the sum of 64 samples * 3.5
+			f s = 224. / q->n;
+			i r = 13 + q->r * s, gr = 13 + q->g * s, bl = 13 + q->b * s;
+
+			int offset = (y * X + x) * 4; // Calculate the offset into video memory for this pixel
+			frame_buffer[offset++] = bl > 255 ? 255 : bl; // Output RGB values directly to video memory
+			frame_buffer[offset++] = gr > 255 ? 255 : gr;
+			frame_buffer[offset++] = r > 255 ? 255 : r;
+			frame_buffer[offset++] = 0;
+		}
+
+	return traced;
+}
+
+// Entry point for every core, renders every pass. APs arrive here straight
+// from the kernel, so realign the stack for the SSE/AVX spills
+__attribute__((force_align_arg_pointer)) int render()
 {
-	b_system(SMP_LOCK, lock, 0);
-	int y = progress++; // Starting line number
-	b_system(SMP_UNLOCK, lock, 0);
+	u64 id = b_system(SMP_ID, 0, 0);
+	u64 me = slotOf[id % 256]; // Our deque slot
+	rng *state = &core_rng[id % MAXCORES]; // Our random number state
 	vector g = v_norm(v_init(5, -28, 7)); // Camera direction (-/+ = Right/Left, ?/? , Down/Up)
 	vector a = v_mul(v_norm(v_cross(v_init(0, 0, -1), g)), .002); // Camera up vector
 	vector b = v_mul(v_norm(v_cross(g, a)), .002);
 	vector c = v_add(v_add(v_mul(a, -256), v_mul(b, -256)), g);
-
-	for (; y<Y; y+=TOTALCORES) // Increment by the number of CPUs
-		for (i x = 0; x<X; x++) {
-			int offset = (y * X + x) * 4; // Calculate the offset into video memory for this line
-
-			vector p = v_init(13, 13, 13); // Reuse the vector class to store the RGB values of a pixel
-			for (i r = 64; r--;) {
-				vector t = v_add(v_mul(a, (R() - .5) * 99), v_mul(b, (R() - .5) * 99));
-				p = v_add(v_mul(S(v_add(v_init(17, 16, 8), t), v_norm(v_add(v_mul(t, -1), v_mul(v_add(v_add(v_mul(a, R() + x), v_mul(b, y + R())), c), 16)))), 3.5), p);
+	u32 sense = 0;
+	i tile;
+
+	for (u32 p = 0; p < PASSES; p++) {
+		u64 traced = 0;
+
+		perf_begin(me);
+
+		// Work through our own tiles first
+		while ((tile = pop_tile(&queue[me])) >= 0)
+			traced += render_tile(tile, a, b, c, state);
+
+		// Then steal from the other cores until every deque is empty, from
+		// those of our package first
+		for (int near = 1; near >= 0; near--)
+			for (u64 n = 1; n < TOTALCORES; n++) {
+				u64 victim = (me + n) % TOTALCORES;
+				if ((slotPackage[victim] == slotPackage[me]) != near)
+					continue;
+				while ((tile = steal_tile(&queue[victim])) >= 0)
+					traced += render_tile(tile, a, b, c, state);
 			}
 
-			frame_buffer[offset++] = (i)p.z; // Output RGB values directly to video memory
-			frame_buffer[offset++] = (i)p.y;
-			frame_buffer[offset++] = (i)p.x;
-			frame_buffer[offset++] = 0;
+		perf_count(me, PERF_PIXELS, traced);
+		perf_count(me, PERF_RAYS, (u64)traced * samples[pass]);
+		perf_end(me);
+
+		// Once every core is done with the pass, the first one sets up the
+		// next while the others wait
+		smp_barrierWait(&passDone, &sense);
+		if (me == 0) {
+			pass++;
+			init_tiles(TOTALCORES);
 		}
+		smp_barrierWait(&passDone, &sense);
+	}
+	return 0;
 }
 
 void cls()
@@ -228,14 +581,59 @@ void cls()
 		frame_buffer[bytes] = pixel;
 }
 
+// Render the image in progressive passes on the given number of cores
+void run(u64 cores)
+{
+	u8 aps[MAXCORES];
+	u32 started = 0;
+
+	// The BSP and the first cores - 1 others in topology order
+	TOTALCORES = 0;
+	for (u32 t = 0; t < topology.cores; t++) {
+		u8 id = topology.order[t];
+		if (id != BSP) {
+			if (started + 1 >= cores)
+				continue;
+			aps[started++] = id;
+		}
+		slotPackage[TOTALCORES] = topology.cpu[id].package;
+		slotOf[id] = TOTALCORES++;
+	}
+
+	for (u64 k = 0; k < (u64)X * Y; k++)
+		accum[k] = (acc){0};
+
+	perf_reset();
+
+	pass = 0;
+	init_tiles(TOTALCORES);
+	smp_barrierInit(&passDone, TOTALCORES);
+
+	for (u32 t = 0; t < started; t++)
+		b_system(SMP_SET, (u64)render, aps[t]); // Have each AP render
+	render(); // Have the BSP render as well, back once every core is done
+
+	// The whole render is one frame: time, pixels traced, primary rays and
+	// busy time of every core
+	char text[PERF_LINES][PERF_LINE];
+	perf_frame();
+	u32 lines = perf_text(text);
+	for (u32 l = 0; l < lines; l++) {
+		b_output("\n", 1);
+		b_output(text[l], strlen(text[l]));
+	}
+}
+
 int main() {
 	frame_buffer = (u8 *)b_system(SCREEN_LFB_GET, 0, 0); // Frame buffer address from kernel
-	cpu_table = (u32 *)0x5100;
+	accum = (acc *)ACCUM_MEMORY;
 	X = b_system(SCREEN_X_GET, 0, 0); // Screen X
 	Y = b_system(SCREEN_Y_GET, 0, 0); // Screen Y
-	u32 tcore;
+	BSP = b_system(SMP_ID, 0, 0); // ID of the BSP
+	topology_init();
+	init_spheres();
+	perf_init(1);
 	u8 c;
-	int busy;
 
 	b_output("raytrace - First run will be using 1 CPU core\nPress any key to continue", 71);
 
@@ -246,11 +644,7 @@ int main() {
 
 	cls();
 
-	TOTALCORES = 1;
-	render();
-
-	TOTALCORES = b_system(SMP_NUMCORES, 0, 0); // Total cores in the system
-	BSP = b_system(SMP_ID, 0, 0); // ID of the BSP
+	run(1);
 
 	b_output("\nRender complete. Second run will use all CPU cores\nPress any key to continue", 77);
 
@@ -261,18 +655,7 @@ int main() {
 
 	cls();
 
-	for (u8 t=0; t<TOTALCORES; t++)
-	{
-		tcore = cpu_table[t]; // Location of the Active CPU IDs
-		if (tcore != BSP)
-			b_system(SMP_SET, (u64)render, tcore); // Have each AP render
-	}
-	render(); // Have the BSP render as well
-
-	// Wait for all other cores to be finished
-	do {
-		busy = b_system(SMP_BUSY, 0, 0);
-	} while (busy == 1);
+	run(b_system(SMP_NUMCORES, 0, 0)); // Total cores in the system
 
 	b_output("\nRender complete. Press any key to exit", 39);
 
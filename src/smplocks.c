@@ -0,0 +1,99 @@
+// smplocks.c -- Check the locks and counters of utils/smp.h on every core
+
+// Every core adds 1 to a shared total ROUNDS times under the ticket lock,
+// ROUNDS times under the MCS lock and ROUNDS times to a counter of its own,
+// then the BSP checks each total against cores * ROUNDS. A lock that lets two
+// cores in at once loses some of the additions. main returns 1 when a total
+// is off, which is the exit status of the hosted build (see check.sh).
+//
+// The locks hand over in the order the cores asked, so the hosted build with
+// more cores than the machine has CPUs crawls: a thread next in line that
+// isn't running holds up every thread behind it for a time slice.
+
+#include "libBareMetal.h"
+#include "utils/smp.h"
+#include "utils/perf.h" // perf_append
+
+#ifndef ROUNDS
+#define ROUNDS 20000
+#endif
+
+smp_ticketLock ticketLock;
+smp_mcsLock mcsLock;
+uint64_t ticketTotal, mcsTotal;    // written under the locks only
+smp_counter slots;                 // hands out the counters below
+smp_counter counters[256];
+smp_barrier done;
+
+// Adds 1 slowly, so a second core let in by a broken lock has time to read
+// the same total
+static inline uint64_t add(uint64_t total) {
+	asm volatile ("pause; pause; pause; pause" : "+r"(total));
+	return total + 1;
+}
+
+// Entry point for every core. APs arrive here straight from the kernel, so
+// realign the stack.
+__attribute__((force_align_arg_pointer)) int contend() {
+	uint32_t slot = smp_counterAdd(&slots, 1), sense = 0;
+	smp_mcsNode node;
+
+	for (uint32_t i = 0; i < ROUNDS; i++) {
+		smp_ticketAcquire(&ticketLock);
+		ticketTotal = add(ticketTotal);
+		smp_ticketRelease(&ticketLock);
+	}
+
+	for (uint32_t i = 0; i < ROUNDS; i++) {
+		smp_mcsAcquire(&mcsLock, &node);
+		mcsTotal = add(mcsTotal);
+		smp_mcsRelease(&mcsLock, &node);
+	}
+
+	for (uint32_t i = 0; i < ROUNDS; i++)
+		smp_counterAdd(&counters[slot], 1);
+
+	smp_barrierWait(&done, &sense); // the BSP goes on once every core is done
+	return 0;
+}
+
+// Prints one total, returns 1 when it is off
+int report(const char *name, uint64_t total, uint64_t expected) {
+	char text[PERF_LINE * 2], *t = perf_append(text, "\n");
+
+	t = perf_append(t, name);
+	t = perf_appendNumber(t, total, 0);
+	t = perf_append(t, " of ");
+	t = perf_appendNumber(t, expected, 0);
+	t = perf_append(t, total == expected ? ", pass" : ", FAIL");
+	b_output(text, t - text);
+	return total != expected;
+}
+
+int main() {
+	uint64_t bsp = b_system(SMP_ID, 0, 0);
+	uint32_t cores = b_system(SMP_NUMCORES, 0, 0);
+	char text[PERF_LINE], *t;
+	int failed = 0;
+
+	if (cores > 256)
+		cores = 256;
+
+	t = perf_append(text, "smplocks - ");
+	t = perf_appendNumber(t, cores, 0);
+	t = perf_append(t, " cores");
+	b_output(text, t - text);
+
+	smp_barrierInit(&done, cores);
+	for (uint32_t c = 0; c < cores; c++)
+		if (cpu_table[c] != bsp)
+			b_system(SMP_SET, (uint64_t)contend, cpu_table[c]);
+	contend();
+
+	uint64_t expected = (uint64_t)cores * ROUNDS;
+	failed |= report("ticket lock  ", ticketTotal, expected);
+	failed |= report("MCS lock     ", mcsTotal, expected);
+	failed |= report("counters     ", smp_counterSum(counters, cores), expected);
+	b_output("\n", 1);
+	return failed;
+}
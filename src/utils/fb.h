@@ -0,0 +1,273 @@
+#ifndef __FB_H__
+#define __FB_H__
+
+#include <stdint.h>
+#include "../libBareMetal.h"
+#include "memory.h"
+#include "smp.h"
+
+// The frame buffer of the graphics demos: finds the screen, sets up the back
+// buffers, presents the frames and saves and restores the screen of the CLI.
+//
+// Drawing goes to fb.back, which is double or triple buffered. Pixels are
+// packed 32 bit words (fb_rgb), fb.row holds a pointer to each row of fb.back
+// so that drawing code can find a row without multiplying by the pitch. With
+// double buffering there is one back buffer and fb_present copies it to the
+// screen before returning. With triple buffering there are two back buffers
+// that take turns: fb_present hands the finished one to another core, which
+// copies it to the screen while the next frame is drawn into the other one.
+//
+// Only the parts of a frame that changed are copied. The screen is split into
+// FB_TILE x FB_TILE tiles, the drawing code marks the areas it writes with
+// fb_mark, fb_clear clears everything drawn the last time the back buffer was
+// used and fb_present copies the tiles drawn in this frame or in the frame on
+// the screen, one copy per pixel row for every run of neighbouring tiles. A
+// demo drawing into a window of the screen never touches the rest of it.
+
+#ifndef FB_MEMORY
+// Where the saved screen and the back buffers are placed
+#define FB_MEMORY 0xFFFF800000F00000
+#endif
+
+#ifndef FB_TILE
+#define FB_TILE 16
+#endif
+
+#ifndef FB_MAX_HEIGHT
+#define FB_MAX_HEIGHT 2160
+#endif
+
+#ifndef FB_MAX_TILES
+// Enough for 4096 x FB_MAX_HEIGHT
+#define FB_MAX_TILES ((4096 / FB_TILE) * ((FB_MAX_HEIGHT + FB_TILE - 1) / FB_TILE))
+#endif
+
+#define fb_rgb(r, g, b)                                                         \
+	(((uint32_t)(uint8_t)(r) << 16) | ((uint32_t)(uint8_t)(g) << 8) | (uint8_t)(b))
+
+static struct {
+	unsigned char *back;         // the back buffer to draw into
+	uint32_t **row;              // the rows of the back buffer
+	unsigned char *video, *save; // the screen and the CLI screen saved
+	unsigned char *end;          // free memory after the back buffers
+	uint32_t width, height;
+	uint32_t pitch, videoPitch;  // bytes per row of the back buffers, screen
+	uint32_t buffers;            // 2 for double buffering, 3 for triple
+	uint32_t presenter;          // core presenting with triple buffering
+
+	unsigned char *buffer[2];
+	uint32_t *rows[2][FB_MAX_HEIGHT];
+	uint32_t current;            // index of the back buffer
+	uint32_t presentedBuffer;    // buffer being presented by the presenter
+	uint32_t presenting;         // the presenter is busy
+
+	uint32_t tilesX, tilesY;
+	uint8_t drawn[2][FB_MAX_TILES]; // drawn in the frame in each back buffer
+	uint8_t shown[FB_MAX_TILES];    // drawn in the frame on the screen
+	uint8_t copy[FB_MAX_TILES];     // tiles for the present in progress
+} fb;
+
+// Marks a rectangle of the back buffer as drawn, the parts outside of the
+// screen are ignored.
+static inline void fb_mark(int32_t x, int32_t y, int32_t width, int32_t height) {
+	int32_t x1 = x + width, y1 = y + height;
+	uint8_t *drawn = fb.drawn[fb.current];
+
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (x1 > (int32_t)fb.width)
+		x1 = fb.width;
+	if (y1 > (int32_t)fb.height)
+		y1 = fb.height;
+	if (x >= x1 || y >= y1)
+		return;
+
+	for (int32_t ty = y / FB_TILE; ty <= (y1 - 1) / FB_TILE; ty++)
+		for (int32_t tx = x / FB_TILE; tx <= (x1 - 1) / FB_TILE; tx++)
+			drawn[ty * fb.tilesX + tx] = 1;
+}
+
+// The drawing functions don't check the screen bounds. fb_putpixel leaves
+// marking to the caller, the span and rectangle functions mark what they draw.
+static inline void fb_putpixel(int32_t x, int32_t y, uint32_t color) {
+	fb.row[y][x] = color;
+}
+
+static inline void fb_fillSpan(int32_t x, int32_t y, int32_t length, uint32_t color) {
+	uint32_t *pixel = fb.row[y] + x;
+
+	for (int32_t i = 0; i < length; i++)
+		pixel[i] = color;
+
+	fb_mark(x, y, length, 1);
+}
+
+// Copies a width x height rectangle of pixels, pitch pixels apart in source
+static inline void fb_blitRect(int32_t x, int32_t y, int32_t width, int32_t height, const uint32_t *source, uint32_t pitch) {
+	for (int32_t i = 0; i < height; i++, source += pitch)
+		memcpy(fb.row[y + i] + x, source, width * 4);
+
+	fb_mark(x, y, width, height);
+}
+
+// Calls f(buffer, x, y, bytes) for every pixel row of every run of
+// neighbouring tiles whose flags are set, x and y being the first pixel, and
+// clears the flags.
+#define fb_forRuns(flags, f, buffer)                                            \
+	for (uint32_t ty = 0; ty < fb.tilesY; ty++) {                               \
+		uint8_t *row = flags + ty * fb.tilesX;                                  \
+		for (uint32_t tx = 0; tx < fb.tilesX; tx++) {                           \
+			if (!row[tx])                                                       \
+				continue;                                                       \
+			uint32_t start = tx;                                                \
+			while (tx < fb.tilesX && row[tx])                                   \
+				row[tx++] = 0;                                                  \
+			uint32_t x = start * FB_TILE;                                       \
+			uint32_t x1 = tx * FB_TILE;                                         \
+			if (x1 > fb.width)                                                  \
+				x1 = fb.width;                                                  \
+			uint32_t y1 = (ty + 1) * FB_TILE;                                   \
+			if (y1 > fb.height)                                                 \
+				y1 = fb.height;                                                 \
+			for (uint32_t y = ty * FB_TILE; y < y1; y++)                        \
+				f(buffer, x, y, (x1 - x) * 4);                                  \
+		}                                                                       \
+	}
+
+#define fb_clearRow(buffer, x, y, bytes)                                        \
+	memset(buffer + (y) * fb.pitch + (x) * 4, 0, bytes)
+
+// Video memory is write combined, so it's written with streaming stores
+#define fb_copyRow(buffer, x, y, bytes)                                         \
+	memcpy_stream(fb.video + (y) * fb.videoPitch + (x) * 4,                     \
+	              buffer + (y) * fb.pitch + (x) * 4, bytes)
+
+// Copies the tiles that differ between back buffer b and the screen
+static inline void fb_presentBuffer(uint32_t b) {
+	for (uint32_t i = 0; i < fb.tilesX * fb.tilesY; i++) {
+		fb.copy[i] = fb.drawn[b][i] | fb.shown[i];
+		fb.shown[i] = fb.drawn[b][i];
+	}
+
+	fb_forRuns(fb.copy, fb_copyRow, fb.buffer[b])
+}
+
+// Entry point of the presenting core
+__attribute__((force_align_arg_pointer)) static void fb_presentWorker(void) {
+	fb_presentBuffer(fb.presentedBuffer);
+	__atomic_store_n(&fb.presenting, 0, __ATOMIC_RELEASE);
+}
+
+// Waits until the presenting core is done with the last frame
+static inline void fb_wait() {
+	while (__atomic_load_n(&fb.presenting, __ATOMIC_ACQUIRE))
+		asm volatile ("pause");
+}
+
+// Clears (to black) everything drawn the last time the back buffer was used,
+// the rest of it is black already.
+static inline void fb_clear() {
+	fb_forRuns(fb.drawn[fb.current], fb_clearRow, fb.back)
+}
+
+// Shows the frame drawn in the back buffer. With triple buffering the frame
+// is copied by the presenting core and fb.back is the other buffer after.
+static inline void fb_present() {
+	if (fb.buffers == 2) {
+		fb_presentBuffer(0);
+		return;
+	}
+
+	fb_wait(); // the presenter can only take one frame at a time
+	fb.presentedBuffer = fb.current;
+
+	if (fb.presenter == b_system(SMP_ID, 0, 0)) {
+		fb_presentBuffer(fb.current);
+	} else {
+		__atomic_store_n(&fb.presenting, 1, __ATOMIC_RELEASE);
+		b_system(SMP_SET, (uint64_t)fb_presentWorker, fb.presenter);
+	}
+
+	fb.current ^= 1;
+	fb.back = fb.buffer[fb.current];
+	fb.row = fb.rows[fb.current];
+}
+
+// Sets up double (buffers = 2) or triple (3) buffering on the screen. Triple
+// buffering presents on fb.presenter, the last core of the CPU list other than
+// the calling one, which shouldn't be given other work. On a single core it
+// presents on the calling core.
+static inline void fb_init(uint32_t buffers) {
+	fb.video = (unsigned char *)b_system(SCREEN_LFB_GET, 0, 0);
+	fb.width = b_system(SCREEN_X_GET, 0, 0);
+	fb.height = b_system(SCREEN_Y_GET, 0, 0);
+	if (fb.height > FB_MAX_HEIGHT)
+		fb.height = FB_MAX_HEIGHT;
+#ifdef SCREEN_PPSL_GET
+	fb.videoPitch = b_system(SCREEN_PPSL_GET, 0, 0) * 4; // pixels per scan line
+#else
+	fb.videoPitch = fb.width * 4;
+#endif
+	fb.pitch = (fb.width * 4 + 63) & ~63; // rows start on a cache line
+	fb.buffers = buffers == 3 ? 3 : 2;
+
+	// 2 MiB apart, the size of a large page
+	uint64_t size = (uint64_t)fb.pitch * fb.height;
+	uint64_t videoSize = (uint64_t)fb.videoPitch * fb.height;
+	uint64_t stride = ((size > videoSize ? size : videoSize) + 0x1FFFFF) & ~(uint64_t)0x1FFFFF;
+
+	fb.save = (unsigned char *)FB_MEMORY;
+	fb.buffer[0] = fb.save + stride;
+	fb.buffer[1] = fb.save + 2 * stride;
+	fb.end = fb.save + fb.buffers * stride;
+	for (uint32_t y = 0; y < fb.height; y++) {
+		fb.rows[0][y] = (uint32_t *)(fb.buffer[0] + y * fb.pitch);
+		fb.rows[1][y] = (uint32_t *)(fb.buffer[1] + y * fb.pitch);
+	}
+	fb.current = 0;
+	fb.back = fb.buffer[0];
+	fb.row = fb.rows[0];
+
+	uint32_t cores = b_system(SMP_NUMCORES, 0, 0), self = b_system(SMP_ID, 0, 0);
+	fb.presenter = self;
+	for (uint32_t i = 0; i < cores && fb.buffers == 3; i++)
+		if (cpu_table[i] != self)
+			fb.presenter = cpu_table[i];
+
+	fb.tilesX = (fb.width + FB_TILE - 1) / FB_TILE;
+	fb.tilesY = (fb.height + FB_TILE - 1) / FB_TILE;
+	if (fb.tilesX * fb.tilesY > FB_MAX_TILES)
+		fb.tilesY = FB_MAX_TILES / fb.tilesX;
+
+	// The first frame replaces the whole screen
+	memset(fb.buffer[0], 0, size);
+	if (fb.buffers == 3)
+		memset(fb.buffer[1], 0, size);
+	memset(fb.drawn, 0, sizeof(fb.drawn));
+	memset(fb.shown, 1, sizeof(fb.shown));
+}
+
+// Saves what's on the screen
+static inline void fb_save() {
+	memcpy(fb.save, fb.video, (uint64_t)fb.videoPitch * fb.height);
+}
+
+// Copies what's on the screen into the back buffer, for drawing on top of it
+static inline void fb_grab() {
+	for (uint32_t y = 0; y < fb.height; y++)
+		memcpy(fb.row[y], fb.video + (uint64_t)y * fb.videoPitch, fb.width * 4);
+}
+
+// Waits for the last frame to be presented and puts the saved screen back
+static inline void fb_restore() {
+	fb_wait();
+	memcpy(fb.video, fb.save, (uint64_t)fb.videoPitch * fb.height);
+}
+
+#undef fb_forRuns
+#undef fb_clearRow
+#undef fb_copyRow
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __FONT_H__
+#define __FONT_H__
+
+#include <stdint.h>
+#include "fb.h"
+
+// A 5 x 7 pixel font for text drawn into the frame buffer, such as frame
+// counters. Covers ASCII 0x20 to 0x5F, lowercase letters are drawn in
+// uppercase and other characters as spaces.
+
+#define FONT_WIDTH 5
+#define FONT_HEIGHT 7
+#define FONT_ADVANCE (FONT_WIDTH + 1)
+
+// One byte per column, bit 0 is the top row
+static const uint8_t font_glyphs[64][FONT_WIDTH] = {
+	{0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, // space !
+	{0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14}, // " #
+	{0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, // $ %
+	{0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, // & '
+	{0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00}, // ( )
+	{0x14, 0x08, 0x3E, 0x08, 0x14}, {0x08, 0x08, 0x3E, 0x08, 0x08}, // * +
+	{0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, // , -
+	{0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02}, // . /
+	{0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, // 0 1
+	{0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31}, // 2 3
+	{0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, // 4 5
+	{0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03}, // 6 7
+	{0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, // 8 9
+	{0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00}, // : ;
+	{0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, // < =
+	{0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, // > ?
+	{0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E}, // @ A
+	{0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22}, // B C
+	{0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, // D E
+	{0x7F, 0x09, 0x09, 0x09, 0x01}, {0x3E, 0x41, 0x49, 0x49, 0x7A}, // F G
+	{0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00}, // H I
+	{0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41}, // J K
+	{0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x0C, 0x02, 0x7F}, // L M
+	{0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E}, // N O
+	{0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, // P Q
+	{0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31}, // R S
+	{0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F}, // T U
+	{0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x3F, 0x40, 0x38, 0x40, 0x3F}, // V W
+	{0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07}, // X Y
+	{0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00}, // Z [
+	{0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, // \ ]
+	{0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40}, // ^ _
+};
+
+// Draws text with its top left corner at x, y, every font pixel being a
+// scale x scale square, on a box of the background color one font pixel
+// wider on each side. Returns the width of the box. The text must fit on the
+// screen.
+static inline int32_t font_draw(int32_t x, int32_t y, const char *text, uint32_t color, uint32_t background, int32_t scale) {
+	int32_t length = 0;
+	while (text[length])
+		length++;
+
+	int32_t width = (length * FONT_ADVANCE + 1) * scale;
+	for (int32_t i = 0; i < (FONT_HEIGHT + 2) * scale; i++)
+		fb_fillSpan(x, y + i, width, background);
+
+	x += scale;
+	y += scale;
+	for (int32_t i = 0; i < length; i++, x += FONT_ADVANCE * scale) {
+		char c = text[i];
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (c < 0x20 || c > 0x5F)
+			c = ' ';
+
+		const uint8_t *glyph = font_glyphs[c - 0x20];
+		for (int32_t column = 0; column < FONT_WIDTH; column++)
+			for (int32_t row = 0; row < FONT_HEIGHT; row++) {
+				if (!(glyph[column] >> row & 1))
+					continue;
+				for (int32_t j = 0; j < scale * scale; j++)
+					fb_putpixel(x + column * scale + j % scale, y + row * scale + j / scale, color);
+			}
+	}
+
+	return width;
+}
+
+#endif
@@ -20,20 +20,16 @@ static inline float fmax(float x, float y) {
     return (x > y) ? x : y;
 }
 
-// Function to compute the square root of a number using the Newton-Raphson method
+// 4 lane float vector, also used to reach single-lane SSE instructions
+typedef float vec4f __attribute__((vector_size(16)));
+typedef int32_t vec4i __attribute__((vector_size(16)));
+
+// Function to compute the square root of a number with the sqrtss instruction
+// (the builtin picks the VEX encoding in AVX builds, avoiding transition stalls)
 static inline float sqrt(float x) {
     if (x < 0) return 0.0 / 0.0; // Return NaN for negative input
-    if (x == 0 || x == 1) return x;
-
-    float result = x;
-    float delta;
-    do {
-        float prev_result = result;
-        result = 0.5 * (prev_result + x / prev_result);
-        delta = prev_result - result;
-    } while (delta > 0.00001 || delta < -0.00001);
 
-    return result;
+    return __builtin_ia32_sqrtss((vec4f){x})[0];
 }
 
 // Function to return the largest integer value less than or equal to x
@@ -45,16 +41,28 @@ static inline float floor(float x) {
     return (float)xi;
 }
 
+// Function to return the smallest integer value greater than or equal to x
+static inline float ceil(float x) {
+    int32_t xi = (int32_t)x;
+    if (x > 0 && x != xi) {
+        return (float)(xi + 1);
+    }
+    return (float)xi;
+}
+
 // Function to compute the power of a number with an integer exponent
+// Uses exponentiation by squaring, so at most 2 * log2(exp) multiplies
 static inline float pow(float base, int exp) {
     if (exp == 0) return 1;
     if (base == 0) return 0;
 
     float result = 1;
-    int positive_exp = (exp > 0) ? exp : -exp;
+    unsigned int e = (exp > 0) ? exp : -exp;
 
-    for (int i = 0; i < positive_exp; ++i) {
-        result *= base;
+    while (e) {
+        if (e & 1) result *= base;
+        base *= base;
+        e >>= 1;
     }
 
     if (exp < 0) result = 1 / result;
@@ -94,23 +102,85 @@ static inline float fmod(float x, float y) {
     return remainder;
 }
 
-// Sine function using Taylor series approximation
+// Sine and cosine functions
+// Reduce x to [-PI/2, PI/2] and evaluate a fixed degree 11 odd polynomial
+// (Taylor coefficients), absolute error below 2e-6 for |x| < 2^16
+#define SIN_2PI_HI 6.28125f // 2 * PI split in two so k * SIN_2PI_HI is exact
+#define SIN_2PI_LO 1.9353071795864769e-3f
+#define SIN_C3  -1.6666666666666666e-1f
+#define SIN_C5   8.3333333333333333e-3f
+#define SIN_C7  -1.9841269841269841e-4f
+#define SIN_C9   2.7557319223985891e-6f
+#define SIN_C11 -2.5052108385441719e-8f
+
+// Return sin(x + phase * 2 * PI), phase is 0 for sin and 0.25 for cos
+// Adding the phase after the reduction keeps cos() as accurate as sin()
+static inline float sin_phase(float x, float phase) {
+    // Reduce to [-PI, PI] by removing the nearest multiple of 2 * PI
+    float k = x * (float)(1 / (2 * PI)) + phase;
+    k = (float)(int32_t)(k + (k < 0 ? -0.5f : 0.5f));
+    x = (x - k * SIN_2PI_HI) - k * SIN_2PI_LO + phase * (float)(2 * PI);
+
+    // sin(PI - x) == sin(x), fold into [-PI/2, PI/2]
+    if (x > (float)(PI / 2)) x = (float)PI - x;
+    if (x < (float)(-PI / 2)) x = (float)-PI - x;
+
+    float x2 = x * x;
+    return x + x * x2 * (SIN_C3 + x2 * (SIN_C5 + x2 * (SIN_C7 + x2 * (SIN_C9 + x2 * SIN_C11))));
+}
+
 static inline float sin(float x) {
-    x = fmod(x, 2 * PI);
-    if (x > PI) x -= 2 * PI;
-    if (x < -PI) x += 2 * PI;
-
-    float term = x;
-    float sum = 0;
-    int sign = 1;
-    int loopCount = 0;
-
-    for (int i = 1;(term > 0.00001 || term < -0.00001) && loopCount < 100; i += 2, loopCount++) {
-        sum += sign * term;
-        term = term * x * x / ((i + 1) * (i + 2));
-        sign = -sign;
-    }
+    return sin_phase(x, 0);
+}
 
-    return sum;
+static inline float cos(float x) {
+    return sin_phase(x, 0.25f);
 }
+
+// 4 and 8 lane variants of sqrt, sin and cos
+// The 8 lane versions are only available when building with -mavx
+#ifdef __AVX__
+typedef float vec8f __attribute__((vector_size(32)));
+typedef int32_t vec8i __attribute__((vector_size(32)));
+#endif
+
+// Defines sin and cos for one vector width, same algorithm as sin_phase()
+#define MATH_VECTOR_SIN(n)                                                      \
+static inline vec##n##f sin_phase##n(vec##n##f x, float phase) {               \
+    vec##n##f zero = {0}, half = zero + 0.5f;                                   \
+    vec##n##f k = x * (float)(1 / (2 * PI)) + phase;                            \
+    vec##n##i neg = k < zero;                                                   \
+    k += (vec##n##f)(((vec##n##i)-half & neg) | ((vec##n##i)half & ~neg));      \
+    k = __builtin_convertvector(__builtin_convertvector(k, vec##n##i), vec##n##f); \
+    x = (x - k * SIN_2PI_HI) - k * SIN_2PI_LO + phase * (float)(2 * PI);        \
+    vec##n##i hi = x > zero + (float)(PI / 2);                                  \
+    vec##n##i lo = x < zero + (float)(-PI / 2);                                 \
+    vec##n##f fold = (float)PI - x, foldn = (float)-PI - x;                     \
+    x = (vec##n##f)(((vec##n##i)fold & hi) | ((vec##n##i)foldn & lo) | ((vec##n##i)x & ~(hi | lo))); \
+    vec##n##f x2 = x * x;                                                       \
+    return x + x * x2 * (SIN_C3 + x2 * (SIN_C5 + x2 * (SIN_C7 + x2 * (SIN_C9 + x2 * SIN_C11)))); \
+}                                                                               \
+                                                                                \
+static inline vec##n##f sin##n(vec##n##f x) {                                   \
+    return sin_phase##n(x, 0);                                                  \
+}                                                                               \
+                                                                                \
+static inline vec##n##f cos##n(vec##n##f x) {                                   \
+    return sin_phase##n(x, 0.25f);                                              \
+}
+
+MATH_VECTOR_SIN(4)
+
+static inline vec4f sqrt4(vec4f x) {
+    return __builtin_ia32_sqrtps(x);
+}
+
+#ifdef __AVX__
+MATH_VECTOR_SIN(8)
+
+static inline vec8f sqrt8(vec8f x) {
+    return __builtin_ia32_sqrtps256(x);
+}
+#endif
+
 #endif
@@ -12,15 +12,10 @@
 #include <stdint.h>  // For integer types
 #include <stdbool.h> // For bool type
 
-// Internal helper function to calculate square root using the Newton-Raphson method
+// Internal helper function to calculate square root with the sqrtss instruction
 static float sqrt_approx(float x) {
-    if(x == 0.0) return 0;
-    float guess = x / 2.0f;
-    float epsilon = 0.00001f;
-    while ((guess * guess) - x > epsilon || (guess * guess) - x < -epsilon) {
-        guess = (guess + x / guess) / 2.0f;
-    }
-    return guess;
+    typedef float sqrt_vec __attribute__((vector_size(16)));
+    return __builtin_ia32_sqrtss((sqrt_vec){x})[0];
 }
 
 // Internal helper function to calculate absolute value for floating point numbers
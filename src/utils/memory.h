@@ -1,23 +1,206 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <stdint.h>
+
+// memcpy and memset use rep movsb/stosb, which the CPUs with ERMS (enhanced
+// rep movsb) run at full speed for any size and alignment. Large blocks and
+// everything written to video memory go through memcpy_stream/memset_stream
+// instead, which use non-temporal stores: these bypass the cache, so a frame
+// copy doesn't evict the data of the next frame, and they fill the write
+// combining buffers of video memory a whole line at a time. The 256 bit AVX
+// variants are used when the CPU and the OS support them, as detected with
+// CPUID the first time they are needed.
+
+#ifndef MEMORY_STREAM_MIN
+// memcpy and memset stream blocks at least this large
+#define MEMORY_STREAM_MIN (1024 * 1024)
+#endif
+
+#define MEMORY_DETECTED 1
+#define MEMORY_ERMS 2
+#define MEMORY_AVX 4
+
+static uint8_t memory_features;
+
+static inline void memory_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+	asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// Returns the MEMORY_ flags of this CPU
+static inline uint8_t memory_detect() {
+	if (memory_features)
+		return memory_features;
+
+	uint32_t a, b, c, d, maxLeaf;
+	uint8_t features = MEMORY_DETECTED;
+
+	memory_cpuid(0, &maxLeaf, &b, &c, &d);
+	memory_cpuid(1, &a, &b, &c, &d);
+
+	// AVX, and OSXSAVE with the OS saving the xmm and ymm registers
+	if ((c & (1 << 28)) && (c & (1 << 27))) {
+		asm volatile ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+		if ((a & 6) == 6)
+			features |= MEMORY_AVX;
+	}
+
+	if (maxLeaf >= 7) {
+		memory_cpuid(7, &a, &b, &c, &d);
+		if (b & (1 << 9))
+			features |= MEMORY_ERMS;
+	}
+
+	memory_features = features;
+	return features;
+}
+
+// Copies (or fills) the unaligned head or the tail of a block
+static inline void memory_copyBytes(unsigned char **d, const unsigned char **s, size_t n) {
+	asm volatile ("rep movsb" : "+D"(*d), "+S"(*s), "+c"(n) : : "memory");
+}
+
+static inline void memory_setBytes(unsigned char **d, int c, size_t n) {
+	asm volatile ("rep stosb" : "+D"(*d), "+c"(n) : "a"(c) : "memory");
+}
+
+// Copies a block with non-temporal stores, for writes to video memory and for
+// blocks too large to stay in the cache anyway
+static inline void *memcpy_stream(void *dest, const void *src, size_t n) {
+	unsigned char *d = (unsigned char *)dest;
+	const unsigned char *s = (const unsigned char *)src;
+	size_t head = -(uintptr_t)d & 31;
+
+	if (n < head + 64) {
+		memory_copyBytes(&d, &s, n);
+		return dest;
+	}
+
+	memory_copyBytes(&d, &s, head);
+	n -= head;
+
+	size_t lines = n & ~(size_t)63; // 64 bytes per iteration
+
+	if (memory_detect() & MEMORY_AVX) {
+		asm volatile (
+			"1:\n\t"
+			"vmovdqu (%1), %%ymm0\n\t"
+			"vmovdqu 32(%1), %%ymm1\n\t"
+			"vmovntdq %%ymm0, (%0)\n\t"
+			"vmovntdq %%ymm1, 32(%0)\n\t"
+			"add $64, %0\n\t"
+			"add $64, %1\n\t"
+			"sub $64, %2\n\t"
+			"jnz 1b\n\t"
+			"vzeroupper" // clears the upper half of every ymm register
+			: "+r"(d), "+r"(s), "+r"(lines) : : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+			  "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15", "memory");
+	} else {
+		asm volatile (
+			"1:\n\t"
+			"movdqu (%1), %%xmm0\n\t"
+			"movdqu 16(%1), %%xmm1\n\t"
+			"movdqu 32(%1), %%xmm2\n\t"
+			"movdqu 48(%1), %%xmm3\n\t"
+			"movntdq %%xmm0, (%0)\n\t"
+			"movntdq %%xmm1, 16(%0)\n\t"
+			"movntdq %%xmm2, 32(%0)\n\t"
+			"movntdq %%xmm3, 48(%0)\n\t"
+			"add $64, %0\n\t"
+			"add $64, %1\n\t"
+			"sub $64, %2\n\t"
+			"jnz 1b"
+			: "+r"(d), "+r"(s), "+r"(lines) : : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+	}
+
+	memory_copyBytes(&d, &s, n & 63);
+	asm volatile ("sfence" : : : "memory"); // non-temporal stores are weakly ordered
+	return dest;
+}
+
+// Fills a block with non-temporal stores, see memcpy_stream
+static inline void *memset_stream(void *s, int c, size_t n) {
+	unsigned char *d = (unsigned char *)s;
+	size_t head = -(uintptr_t)d & 31;
+	uint32_t pattern = (uint8_t)c * 0x01010101u;
+
+	if (n < head + 64) {
+		memory_setBytes(&d, c, n);
+		return s;
+	}
+
+	memory_setBytes(&d, c, head);
+	n -= head;
+
+	size_t lines = n & ~(size_t)63;
+
+	if (memory_detect() & MEMORY_AVX) {
+		asm volatile (
+			"vmovd %2, %%xmm0\n\t"
+			"vpshufd $0, %%xmm0, %%xmm0\n\t"
+			"vinsertf128 $1, %%xmm0, %%ymm0, %%ymm0\n"
+			"1:\n\t"
+			"vmovntdq %%ymm0, (%0)\n\t"
+			"vmovntdq %%ymm0, 32(%0)\n\t"
+			"add $64, %0\n\t"
+			"sub $64, %1\n\t"
+			"jnz 1b\n\t"
+			"vzeroupper" // clears the upper half of every ymm register
+			: "+r"(d), "+r"(lines) : "r"(pattern) : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+			  "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15", "memory");
+	} else {
+		asm volatile (
+			"movd %2, %%xmm0\n\t"
+			"pshufd $0, %%xmm0, %%xmm0\n"
+			"1:\n\t"
+			"movntdq %%xmm0, (%0)\n\t"
+			"movntdq %%xmm0, 16(%0)\n\t"
+			"movntdq %%xmm0, 32(%0)\n\t"
+			"movntdq %%xmm0, 48(%0)\n\t"
+			"add $64, %0\n\t"
+			"sub $64, %1\n\t"
+			"jnz 1b"
+			: "+r"(d), "+r"(lines) : "r"(pattern) : "xmm0", "memory");
+	}
+
+	memory_setBytes(&d, c, n & 63);
+	asm volatile ("sfence" : : : "memory");
+	return s;
+}
+
 void *memcpy(void *dest, const void *src, size_t n) {
 	unsigned char *d = (unsigned char *)dest;
 	const unsigned char *s = (const unsigned char *)src;
 
-	while (n--) {
-		*d++ = *s++;
+	if (n >= MEMORY_STREAM_MIN)
+		return memcpy_stream(dest, src, n);
+
+	// Without ERMS rep movsb is slow, move quadwords first
+	if (!(memory_detect() & MEMORY_ERMS)) {
+		size_t quads = n / 8;
+		asm volatile ("rep movsq" : "+D"(d), "+S"(s), "+c"(quads) : : "memory");
+		n &= 7;
 	}
 
+	memory_copyBytes(&d, &s, n);
 	return dest;
 }
 
 // Function to set a block of memory to a specified value
 static inline void *memset(void *s, int c, unsigned long n) {
-	unsigned char *p = (unsigned char *)s;
-	while (n--) {
-		*p++ = (unsigned char)c;
+	unsigned char *d = (unsigned char *)s;
+
+	if (n >= MEMORY_STREAM_MIN)
+		return memset_stream(s, c, n);
+
+	if (!(memory_detect() & MEMORY_ERMS)) {
+		uint64_t pattern = (uint8_t)c * 0x0101010101010101ull;
+		size_t quads = n / 8;
+		asm volatile ("rep stosq" : "+D"(d), "+c"(quads) : "a"(pattern) : "memory");
+		n &= 7;
 	}
+
+	memory_setBytes(&d, c, n);
 	return s;
 }
 #endif
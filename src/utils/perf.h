@@ -0,0 +1,284 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include "../libBareMetal.h"
+
+// Frame timing and performance counters for the demos.
+//
+// The work of a frame is timed per worker: a worker is whatever the demo
+// hands work to, numbered from 0 (usually the BSP), and calls perf_begin and
+// perf_end around its part of the frame and perf_count for the triangles,
+// pixels and so on it drew. perf_frame ends a frame on the BSP, after every
+// worker is done. The numbers are summed over PERF_WINDOW frames (or the
+// window given to perf_init) and then averaged per frame, the averages of the
+// last finished window are what perf_text and perf_draw show.
+//
+// The time is read from the TSC. Where the CPU has architectural performance
+// monitoring (Intel, version 2 or later) the fixed counters for instructions
+// retired and core cycles are read with RDPMC as well, giving the
+// instructions per cycle of the workers. That needs ring 0, which the demos
+// run in under BareMetal but not in the hosted build.
+
+#ifndef PERF_MAX_WORKERS
+#define PERF_MAX_WORKERS 64
+#endif
+
+#ifndef PERF_WINDOW
+#define PERF_WINDOW 16
+#endif
+
+#define PERF_TRIANGLES 0
+#define PERF_PIXELS 1
+#define PERF_RAYS 2
+#define PERF_COUNTERS 3
+
+#define PERF_LINE 48 // characters per line of text, with the terminating 0
+#define PERF_LINES (5 + PERF_MAX_WORKERS / 8)
+
+typedef struct {
+	uint64_t start, busy;                  // TSC at perf_begin, ticks busy
+	uint64_t instructionsStart, cyclesStart;
+	uint64_t instructions, cycles;
+	uint64_t count[PERF_COUNTERS];
+} __attribute__((aligned(64))) perf_worker;
+
+static struct {
+	uint64_t ticksPerMs;
+	uint32_t pmu;                          // the fixed counters can be used
+	uint64_t counterMask;                  // width of the fixed counters
+	uint32_t window, frames;
+	uint64_t windowStart;
+	perf_worker worker[PERF_MAX_WORKERS];
+
+	// Totals of the last finished window
+	uint32_t shownFrames;
+	uint64_t ticks, busy[PERF_MAX_WORKERS];
+	uint64_t instructions, cycles, count[PERF_COUNTERS];
+} perf;
+
+static inline uint64_t perf_ticks() {
+	return b_system(TSC, 0, 0);
+}
+
+static inline uint64_t perf_rdpmc(uint32_t counter) {
+	uint32_t lo, hi;
+	asm volatile ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t perf_rdmsr(uint32_t msr) {
+	uint32_t lo, hi;
+	asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline void perf_wrmsr(uint32_t msr, uint64_t value) {
+	asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Starts fixed counters 0 (instructions retired) and 1 (core cycles) on the
+// calling core, in all rings. The counters are per core, so every worker
+// does this in perf_begin.
+static inline void perf_enableCounters() {
+	perf_wrmsr(0x38D, perf_rdmsr(0x38D) | 0x33);            // IA32_FIXED_CTR_CTRL
+	perf_wrmsr(0x38F, perf_rdmsr(0x38F) | (3ull << 32));    // IA32_PERF_GLOBAL_CTRL
+}
+
+// Clears the numbers of the current window
+static inline void perf_reset() {
+	for (uint32_t i = 0; i < PERF_MAX_WORKERS; i++) {
+		perf_worker *w = &perf.worker[i];
+		w->busy = w->instructions = w->cycles = 0;
+		for (uint32_t c = 0; c < PERF_COUNTERS; c++)
+			w->count[c] = 0;
+	}
+	perf.frames = 0;
+	perf.windowStart = perf_ticks();
+}
+
+// Measures the TSC frequency and looks for the performance counters. The
+// numbers shown are averaged over window frames.
+static inline void perf_init(uint32_t window) {
+	uint64_t start = perf_ticks();
+	asm volatile ("call *0x00100048" : : "c"(6), "a"(10000)); // wait 10 ms
+	perf.ticksPerMs = (perf_ticks() - start) / 10;
+	if (!perf.ticksPerMs)
+		perf.ticksPerMs = 1;
+
+	uint32_t a, b, c, d;
+	uint16_t cs;
+	asm volatile ("mov %%cs, %0" : "=r"(cs));
+	asm volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0), "c"(0));
+	if (a >= 0xA && (cs & 3) == 0) {
+		asm volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0xA), "c"(0));
+		uint32_t width = (d >> 5) & 0xFF;
+		// Version 2 or later, 2 or more fixed counters
+		perf.pmu = (a & 0xFF) >= 2 && (d & 0x1F) >= 2 && width;
+		perf.counterMask = width >= 64 ? ~0ull : (1ull << width) - 1;
+	}
+
+	perf.window = window ? window : PERF_WINDOW;
+	perf.shownFrames = 0;
+	perf_reset();
+}
+
+// Starts the part of the frame done by worker w
+static inline void perf_begin(uint32_t w) {
+	if (w >= PERF_MAX_WORKERS)
+		return;
+	perf_worker *p = &perf.worker[w];
+
+	if (perf.pmu) {
+		perf_enableCounters();
+		p->instructionsStart = perf_rdpmc(1 << 30);
+		p->cyclesStart = perf_rdpmc(1 << 30 | 1);
+	}
+	p->start = perf_ticks();
+}
+
+// Ends the part of the frame done by worker w
+static inline void perf_end(uint32_t w) {
+	if (w >= PERF_MAX_WORKERS)
+		return;
+	perf_worker *p = &perf.worker[w];
+
+	p->busy += perf_ticks() - p->start;
+	if (perf.pmu) {
+		p->instructions += (perf_rdpmc(1 << 30) - p->instructionsStart) & perf.counterMask;
+		p->cycles += (perf_rdpmc(1 << 30 | 1) - p->cyclesStart) & perf.counterMask;
+	}
+}
+
+// Adds n to counter c (PERF_TRIANGLES, PERF_PIXELS, PERF_RAYS) of worker w
+static inline void perf_count(uint32_t w, uint32_t c, uint64_t n) {
+	if (w < PERF_MAX_WORKERS)
+		perf.worker[w].count[c] += n;
+}
+
+// Ends a frame, once every worker is done with it
+static inline void perf_frame() {
+	if (++perf.frames < perf.window)
+		return;
+
+	uint64_t now = perf_ticks();
+	perf.ticks = now - perf.windowStart;
+	perf.instructions = perf.cycles = 0;
+	for (uint32_t c = 0; c < PERF_COUNTERS; c++)
+		perf.count[c] = 0;
+
+	for (uint32_t i = 0; i < PERF_MAX_WORKERS; i++) {
+		perf_worker *w = &perf.worker[i];
+		perf.busy[i] = w->busy;
+		perf.instructions += w->instructions;
+		perf.cycles += w->cycles;
+		for (uint32_t c = 0; c < PERF_COUNTERS; c++)
+			perf.count[c] += w->count[c];
+	}
+
+	perf.shownFrames = perf.frames;
+	perf_reset();
+	perf.windowStart = now;
+}
+
+static inline char *perf_append(char *text, const char *s) {
+	while (*s)
+		*text++ = *s++;
+	*text = 0;
+	return text;
+}
+
+// Appends value / 10^decimals with the given number of decimals
+static inline char *perf_appendNumber(char *text, uint64_t value, uint32_t decimals) {
+	char digits[24];
+	uint32_t n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value || n <= decimals);
+
+	while (n) {
+		if (n-- == decimals)
+			*text++ = '.';
+		*text++ = digits[n];
+	}
+	*text = 0;
+	return text;
+}
+
+// Writes the averages of the last window as lines of text, returns the
+// number of lines
+static inline uint32_t perf_text(char text[PERF_LINES][PERF_LINE]) {
+	uint32_t lines = 0, frames = perf.shownFrames;
+	char *t;
+
+	if (!frames || !perf.ticks)
+		return 0;
+
+	t = perf_append(text[lines++], "FRAME ");
+	t = perf_appendNumber(t, perf.ticks * 100 / (perf.ticksPerMs * frames), 2);
+	t = perf_append(t, " MS");
+	uint64_t fps = perf.ticksPerMs * 1000 * frames / perf.ticks;
+	if (fps) {
+		t = perf_append(t, "  ");
+		t = perf_appendNumber(t, fps, 0);
+		perf_append(t, " FPS");
+	}
+
+	if (perf.count[PERF_TRIANGLES]) {
+		t = perf_append(text[lines++], "TRIANGLES ");
+		perf_appendNumber(t, perf.count[PERF_TRIANGLES] / frames, 0);
+	}
+
+	if (perf.count[PERF_PIXELS]) {
+		t = perf_append(text[lines++], "PIXELS ");
+		perf_appendNumber(t, perf.count[PERF_PIXELS] / frames, 0);
+	}
+
+	if (perf.count[PERF_RAYS]) {
+		t = perf_append(text[lines++], "RAYS ");
+		t = perf_appendNumber(t, perf.count[PERF_RAYS] / frames, 0);
+		t = perf_append(t, "  ");
+		t = perf_appendNumber(t, perf.count[PERF_RAYS] * perf.ticksPerMs / (perf.ticks * 10), 2);
+		perf_append(t, " MRAYS/S");
+	}
+
+	if (perf.pmu && perf.cycles) {
+		t = perf_append(text[lines++], "IPC ");
+		perf_appendNumber(t, perf.instructions * 100 / perf.cycles, 2);
+	}
+
+	// Busy time of the workers in percent of the frame, 8 to a line
+	for (uint32_t i = 0; i < PERF_MAX_WORKERS; i += 8) {
+		uint32_t used = 0;
+		for (uint32_t j = i; j < i + 8; j++)
+			used |= perf.busy[j] != 0;
+		if (!used)
+			continue;
+
+		t = perf_append(text[lines++], "BUSY ");
+		t = perf_appendNumber(t, i, 0);
+		t = perf_append(t, "-");
+		t = perf_appendNumber(t, i + 7, 0);
+		for (uint32_t j = i; j < i + 8; j++) {
+			t = perf_append(t, " ");
+			t = perf_appendNumber(t, perf.busy[j] * 100 / perf.ticks, 0);
+		}
+	}
+
+	return lines;
+}
+
+#ifdef __FONT_H__
+// Draws the averages of the last window with the top left corner at x, y
+static inline void perf_draw(int32_t x, int32_t y, int32_t scale) {
+	char text[PERF_LINES][PERF_LINE];
+	uint32_t lines = perf_text(text);
+
+	for (uint32_t i = 0; i < lines; i++)
+		font_draw(x, y + i * (FONT_HEIGHT + 2) * scale, text[i], fb_rgb(255, 255, 255), 0, scale);
+}
+#endif
+
+#endif
@@ -16,4 +16,95 @@ static inline int rand() {
     return (int)(seed & 0x7FFFFFFF);
 }
 
+// xoshiro128+ generator with explicit state, for code that runs on several
+// cores at once. Give every core (or every tile) its own state instead of
+// sharing the global seed above.
+typedef struct {
+    uint32_t s[4];
+} rand_state;
+
+// Four independent xoshiro128+ streams advanced together with SSE2
+typedef uint32_t rand_vec __attribute__((vector_size(16)));
+typedef float rand_vecf __attribute__((vector_size(16)));
+typedef int32_t rand_veci __attribute__((vector_size(16)));
+
+typedef struct {
+    rand_vec s[4];
+} rand_state4;
+
+// splitmix64, used to expand a seed into a full state
+static inline uint64_t rand_splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline void rand_seed(rand_state *st, uint64_t s) {
+    uint64_t a = rand_splitmix(&s), b = rand_splitmix(&s);
+    st->s[0] = a;
+    st->s[1] = a >> 32;
+    st->s[2] = b;
+    st->s[3] = b >> 32;
+}
+
+static inline void rand_seed4(rand_state4 *st, uint64_t s) {
+    for (int l = 0; l < 4; l++) {
+        uint64_t a = rand_splitmix(&s), b = rand_splitmix(&s);
+        st->s[0][l] = a;
+        st->s[1][l] = a >> 32;
+        st->s[2][l] = b;
+        st->s[3][l] = b >> 32;
+    }
+}
+
+// Return the next 32-bit value
+static inline uint32_t rand_next(rand_state *st) {
+    uint32_t *s = st->s;
+    uint32_t result = s[0] + s[3];
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 11) | (s[3] >> 21);
+
+    return result;
+}
+
+// Return a float in [0, 1)
+static inline float rand_float(rand_state *st) {
+    return (rand_next(st) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Return the next value of all four streams
+static inline rand_vec rand_next4(rand_state4 *st) {
+    rand_vec *s = st->s;
+    rand_vec result = s[0] + s[3];
+    rand_vec t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 11) | (s[3] >> 21);
+
+    return result;
+}
+
+// Fill out[0..n) with floats in [0, 1), four at a time
+static inline void rand_fill(rand_state4 *st, float *out, int n) {
+    while (n > 0) {
+        rand_veci bits = (rand_veci)(rand_next4(st) >> 8);
+        rand_vecf f = __builtin_convertvector(bits, rand_vecf) * (1.0f / 16777216.0f);
+        for (int l = 0; l < 4 && l < n; l++)
+            out[l] = f[l];
+        out += 4;
+        n -= 4;
+    }
+}
+
 #endif
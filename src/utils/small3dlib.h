@@ -14,16 +14,20 @@
 
   Before including the library, define S3L_PIXEL_FUNCTION to the name of the
   function you'll be using to draw single pixels (this function will be called
-  by the library to render the frames). Also either init S3L_resolutionX and
-  S3L_resolutionY or define S3L_RESOLUTION_X and S3L_RESOLUTION_Y.
+  by the library to render the frames), or S3L_SPAN_FUNCTION to the name of a
+  function drawing horizontal spans of pixels (see S3L_SpanInfo). Also either
+  init S3L_resolutionX and S3L_resolutionY or define S3L_RESOLUTION_X and
+  S3L_RESOLUTION_Y.
 
   You'll also need to decide what rendering strategy and other settings you
   want to use, depending on your specific usecase. You may want to use a
-  z-buffer (full or reduced, S3L_Z_BUFFER), sorted-drawing (S3L_SORT), or even
-  none of these. See the description of the options in this file.
+  z-buffer (full or reduced, S3L_Z_BUFFER, optionally with the hierarchical
+  S3L_HI_Z), sorted-drawing (S3L_SORT), or even none of these. See the
+  description of the options in this file.
 
   The rendering itself is done with S3L_drawScene, usually preceded by
-  S3L_newFrame (for clearing zBuffer etc.).
+  S3L_newFrame (for clearing zBuffer etc.). With S3L_BINNING the frame can
+  instead be drawn on several cores with S3L_binScene and S3L_drawBins.
 
   The library is meant to be used in not so huge programs that use single
   translation unit and so includes both declarations and implementation at once.
@@ -61,7 +65,8 @@
   down, left to right (so you can utilize e.g. various caches), and if sorting
   is disabled the order of rasterization will be that specified in the scene
   structure and model arrays (of course, some triangles and models may be
-  skipped due to culling etc.).
+  skipped due to culling etc.). With S3L_drawBins this only holds within each
+  bin, and pixel function calls for different bins may run at the same time.
 
   Angles are in S3L_Units, a full angle (2 pi) is S3L_FRACTIONS_PER_UNITs.
 
@@ -303,6 +308,39 @@ typedef
   #define S3L_REDUCED_Z_BUFFER_GRANULARITY 5
 #endif
 
+#ifndef S3L_HI_Z
+  /** Whether to keep a hierarchical z-buffer next to the full one: the nearest
+  and farthest depth of each 8x8 pixel tile. S3L_RASTERIZER 1 then checks it
+  for whole triangles, tiles and blocks, skips those that are completely
+  behind what has already been drawn and leaves out the per pixel depth test
+  where they are completely in front. The far bounds are only recomputed when
+  a test needs them, so drawing in front of a tile stays cheap. This pays off
+  with a lot of overdraw, e.g. several overlapping models drawn roughly front
+  to back, a single model gains little. Requires S3L_Z_BUFFER 1, code that
+  writes S3L_zBuffer directly (not with S3L_zBufferWrite) has to call
+  S3L_hiZUpdate. */
+  #define S3L_HI_Z 0
+#endif
+
+#ifndef S3L_Z_BUFFER_TAGS
+  /** If on, the z-buffer isn't cleared by S3L_newFrame. Instead every 8x8 tile
+  of it is tagged with the frame it was last cleared in (S3L_zBufferTags) and
+  S3L_newFrame only moves to a new tag. A tile with an old tag is treated as
+  being at the maximum depth and gets cleared the first time it is drawn to
+  in the frame, so only the tiles that are actually drawn to are ever
+  written. Works with both S3L_Z_BUFFER 1 and 2, code that accesses
+  S3L_zBuffer directly (not with S3L_zBufferRead and S3L_zBufferWrite) has to
+  call S3L_zBufferTouch first. */
+  #define S3L_Z_BUFFER_TAGS 0
+#endif
+
+#ifndef S3L_Z_MAX_TILES
+  /** Number of 8x8 tiles S3L_HI_Z and S3L_Z_BUFFER_TAGS allocate, must be at
+  least the number of tiles that cover the screen. The default is enough for
+  any resolution of at least 8x8 pixels. */
+  #define S3L_Z_MAX_TILES (S3L_MAX_PIXELS / 16)
+#endif
+
 #ifndef S3L_STENCIL_BUFFER
   /** Whether to use stencil buffer for drawing -- with this a pixel that would
   be resterized over an already rasterized pixel (within a frame) will be
@@ -337,6 +375,105 @@ typedef
   #define S3L_MAX_TRIANGES_DRAWN 128
 #endif
 
+#ifndef S3L_BINNING
+  /** If on, S3L_binScene and S3L_drawBins are available to render a scene on
+  several cores at once. S3L_binScene projects all triangles and sorts them
+  into S3L_BIN_SIZE x S3L_BIN_SIZE screen tiles (bins), then every core calls
+  S3L_drawBins, which keeps claiming bins and rasterizing only the part of
+  each triangle that falls into the claimed bin. As no two cores ever touch
+  the same bin, they don't need any locking on the z-buffer. Needs GCC/clang
+  atomic builtins and doesn't work with S3L_SORT, S3L_STENCIL_BUFFER or
+  S3L_NEAR_CROSS_STRATEGY 3 (these rely on a global drawing order or global
+  state). S3L_drawScene stays available. */
+  #define S3L_BINNING 0
+#endif
+
+#ifndef S3L_BIN_SIZE
+  /** Width and height of a bin in pixels for S3L_BINNING. */
+  #define S3L_BIN_SIZE 32
+#endif
+
+#ifndef S3L_MAX_BINS
+  /** Maximum number of bins for S3L_BINNING, must be at least the number of
+  S3L_BIN_SIZE x S3L_BIN_SIZE tiles that cover the screen. */
+  #define S3L_MAX_BINS 4096
+#endif
+
+#ifndef S3L_MAX_BINNED_TRIANGLES
+  /** Maximum number of triangles S3L_binScene can store in a frame, the rest
+  is not drawn. */
+  #define S3L_MAX_BINNED_TRIANGLES 2048
+#endif
+
+#ifndef S3L_MAX_BIN_ENTRIES
+  /** Maximum number of (triangle, bin) pairs S3L_binScene can store in a
+  frame, a triangle that covers N bins uses N entries. */
+  #define S3L_MAX_BIN_ENTRIES (S3L_MAX_BINNED_TRIANGLES * 8)
+#endif
+
+#if S3L_BINNING && (S3L_SORT != 0 || S3L_STENCIL_BUFFER ||\
+  S3L_NEAR_CROSS_STRATEGY == 3)
+  #error S3L_BINNING cannot be used with S3L_SORT, S3L_STENCIL_BUFFER or\
+         S3L_NEAR_CROSS_STRATEGY 3!
+#endif
+
+#if S3L_HI_Z && S3L_Z_BUFFER != 1
+  #error S3L_HI_Z requires S3L_Z_BUFFER 1!
+#endif
+
+#if S3L_Z_BUFFER_TAGS && !S3L_Z_BUFFER
+  #error S3L_Z_BUFFER_TAGS requires S3L_Z_BUFFER!
+#endif
+
+#if (S3L_HI_Z || S3L_Z_BUFFER_TAGS) && S3L_BINNING && S3L_BIN_SIZE % 8 != 0
+  #error S3L_HI_Z and S3L_Z_BUFFER_TAGS with S3L_BINNING require S3L_BIN_SIZE\
+         to be a multiple of 8!
+#endif
+
+#ifndef S3L_VERTEX_CACHE
+  /** If on, S3L_drawScene (and S3L_binScene) project all vertices of a model
+  once into a scratch array and then assemble the triangles from it, instead
+  of projecting every vertex again for each triangle that uses it (about 6
+  times for a typical closed mesh). This costs S3L_MAX_CACHED_VERTICES *
+  sizeof(S3L_Vec4) bytes of memory, models with more vertices are drawn
+  without the cache. The cache can also be switched off at runtime with
+  S3L_vertexCacheEnabled (e.g. for measuring its gain). */
+  #define S3L_VERTEX_CACHE 0
+#endif
+
+#ifndef S3L_MAX_CACHED_VERTICES
+  /** Size of the S3L_VERTEX_CACHE vertex cache, in vertices. */
+  #define S3L_MAX_CACHED_VERTICES 1024
+#endif
+
+#ifndef S3L_RASTERIZER
+  /** Which triangle rasterizer to use. Possible values:
+
+  0: Scanline rasterizer, walks the triangle sides with Bresenham-like steps
+     and interpolates the values along each row pixel by pixel. Works with
+     any compiler.
+  1: Edge function rasterizer, works on square blocks of pixels (4x4, or 8x8
+     when compiled with AVX2) with GCC/clang vector extensions, which the
+     compiler turns into SSE2 or AVX2 integer instructions. Tiles of 4x4
+     blocks and then the blocks themselves that are outside the triangle are
+     skipped as a whole, the ones fully inside skip the edge tests. Without
+     perspective correction the barycentrics and depth are stepped from
+     fixed point gradients, with it they are only computed exactly at the
+     block corners and interpolated bilinearly in between (an approximation
+     similar to S3L_PERSPECTIVE_CORRECTION 2). The barycentrics are more
+     precise than with the scanline rasterizer, and this is faster for big
+     triangles, especially with AVX2. Depth must stay below 2^23. Triangles
+     with screen coordinates beyond S3L_RASTERIZER_MAX_COORD are still drawn
+     with the scanline rasterizer, as the edge functions would overflow. */
+  #define S3L_RASTERIZER 0
+#endif
+
+#ifndef S3L_RASTERIZER_MAX_COORD
+  /** Biggest absolute screen coordinate of a triangle vertex that
+  S3L_RASTERIZER 1 handles, must be at most 8192. */
+  #define S3L_RASTERIZER_MAX_COORD 8192
+#endif
+
 #ifndef S3L_NEAR
   /** Distance of the near clipping plane. Points in front or EXATLY ON this
   plane are considered outside the frustum. This must be >= 0. */
@@ -592,11 +729,47 @@ typedef struct
                                back, e.g. for transparency. */
   S3L_ScreenCoord triangleSize[2]; /**< Rasterized triangle width and height,
                               can be used e.g. for MIP mapping. */
+  uint8_t worker;          /**< Worker number passed to S3L_drawBins, 0 with
+                              S3L_drawScene. Can be used to keep per-core
+                              caches in the pixel function. */
 } S3L_PixelInfo;         /**< Used to pass the info about a rasterized pixel
                               (fragment) to the user-defined drawing func. */
 
 static inline void S3L_pixelInfoInit(S3L_PixelInfo *p);
 
+#define S3L_SPAN_MAX_LENGTH 8 ///< Most pixels a S3L_SpanInfo can hold.
+#define S3L_SPAN_FRACTION 8   ///< Fractional bits of the values of a span.
+
+typedef struct
+{
+  S3L_ScreenCoord x;          ///< Screen X coordinate of the first pixel.
+  S3L_ScreenCoord y;          ///< Screen Y coordinate.
+  uint8_t length;          ///< Number of pixels, up to S3L_SPAN_MAX_LENGTH.
+  uint8_t mask;            /**< Bit i is set if pixel x + i is to be drawn, i.e.
+                              is inside the triangle and passed the stencil and
+                              z-buffer tests. Other pixels must be skipped. */
+  S3L_Unit barycentric[3]; /**< Barycentric coords of the first pixel, scaled
+                              by 2^S3L_SPAN_FRACTION. They change linearly
+                              along the span, so pixel i has barycentric[j] +
+                              i * barycentricStep[j]. Near the triangle edges
+                              they may get slightly out of range, they always
+                              sum up to S3L_FRACTIONS_PER_UNIT (scaled). */
+  S3L_Unit barycentricStep[3]; ///< Change of barycentric per pixel.
+  S3L_Unit depth;          ///< Depth of the first pixel, scaled the same way.
+  S3L_Unit depthStep;      ///< Change of depth per pixel.
+  S3L_Unit previousZ[S3L_SPAN_MAX_LENGTH]; /**< Z-buffer values of the pixels
+                              before rasterization, as in S3L_PixelInfo. */
+  S3L_Index modelIndex;    ///< Model index within the scene.
+  S3L_Index triangleIndex; ///< Triangle index within the model.
+  uint32_t triangleID;     ///< Unique ID of the triangle, as in S3L_PixelInfo.
+  S3L_ScreenCoord triangleSize[2]; ///< Rasterized triangle width and height.
+  uint8_t worker;          ///< Worker number, as in S3L_PixelInfo.
+} S3L_SpanInfo;          /**< Used to pass a horizontal span of pixels of one
+                              triangle to the user-defined S3L_SPAN_FUNCTION,
+                              so that it can do the per triangle work once and
+                              then loop over the pixels. Only S3L_RASTERIZER 1
+                              produces spans longer than one pixel. */
+
 /** Corrects barycentric coordinates so that they exactly meet the defined
   conditions (each fall into <0,S3L_FRACTIONS_PER_UNIT>, sum =
   S3L_FRACTIONS_PER_UNIT). Note that doing this per-pixel can slow the program
@@ -715,6 +888,21 @@ void S3L_drawTriangle(
   S3L_Index modelIndex,
   S3L_Index triangleIndex);
 
+/** Same as S3L_drawTriangle, but only draws the pixels inside the rectangle
+  [clipX0,clipX1) x [clipY0,clipY1), which must lie within the screen, and
+  passes worker on to the pixel function in S3L_PixelInfo. */
+void S3L_drawTriangleClipped(
+  S3L_Vec4 point0,
+  S3L_Vec4 point1,
+  S3L_Vec4 point2,
+  S3L_Index modelIndex,
+  S3L_Index triangleIndex,
+  S3L_ScreenCoord clipX0,
+  S3L_ScreenCoord clipY0,
+  S3L_ScreenCoord clipX1,
+  S3L_ScreenCoord clipY1,
+  uint8_t worker);
+
 /** This should be called before rendering each frame. The function clears
   buffers and does potentially other things needed for the frame. */
 void S3L_newFrame(void);
@@ -730,6 +918,16 @@ void S3L_zBufferWrite(S3L_ScreenCoord x, S3L_ScreenCoord y, S3L_Unit value);
   from z-buffer (if enabled). Does NOT check boundaries! */
 S3L_Unit S3L_zBufferRead(S3L_ScreenCoord x, S3L_ScreenCoord y);
 
+/** For S3L_Z_BUFFER_TAGS, makes sure the z-buffer tile containing given pixel
+  is cleared in this frame. Only needed before accessing S3L_zBuffer
+  directly. */
+void S3L_zBufferTouch(S3L_ScreenCoord x, S3L_ScreenCoord y);
+
+/** Tells S3L_HI_Z (if enabled) that the z-buffer value at given pixel has been
+  changed to given value. Only needed for writes done without
+  S3L_zBufferWrite. */
+void S3L_hiZUpdate(S3L_ScreenCoord x, S3L_ScreenCoord y, S3L_Unit value);
+
 static inline void S3L_rotate2DPoint(S3L_Unit *x, S3L_Unit *y, S3L_Unit angle);
 
 /** Predefined vertices of a cube to simply insert in an array. These come with
@@ -810,6 +1008,45 @@ static inline void S3L_rotate2DPoint(S3L_Unit *x, S3L_Unit *y, S3L_Unit angle);
     S3L_min(255,(depth) >> S3L_REDUCED_Z_BUFFER_GRANULARITY)
 #endif
 
+#if S3L_HI_Z || S3L_Z_BUFFER_TAGS
+#define S3L_Z_TILE 8 ///< size of S3L_HI_Z and S3L_Z_BUFFER_TAGS tiles
+#define S3L_Z_TILES_X\
+  ((S3L_RESOLUTION_X + S3L_Z_TILE - 1) / S3L_Z_TILE)
+#define S3L_Z_TILES_Y\
+  ((S3L_RESOLUTION_Y + S3L_Z_TILE - 1) / S3L_Z_TILE)
+#endif
+
+#if S3L_Z_BUFFER_TAGS
+uint8_t S3L_zBufferTags[S3L_Z_MAX_TILES]; ///< frame tag of each tile's clear
+
+/** Tag of the current frame, 1 in the first frame. When it wraps around, all
+  the tags are reset and it starts over at 1. */
+uint8_t S3L_zBufferTag = 0;
+#endif
+
+void S3L_zBufferTouch(S3L_ScreenCoord x, S3L_ScreenCoord y)
+{
+#if S3L_Z_BUFFER_TAGS
+  uint32_t tile = (y / S3L_Z_TILE) * S3L_Z_TILES_X + x / S3L_Z_TILE;
+
+  if (S3L_zBufferTags[tile] == S3L_zBufferTag)
+    return;
+
+  S3L_zBufferTags[tile] = S3L_zBufferTag;
+
+  S3L_ScreenCoord x0 = x - x % S3L_Z_TILE,
+    x1 = S3L_min(x0 + S3L_Z_TILE,S3L_RESOLUTION_X);
+
+  for (S3L_ScreenCoord row = y - y % S3L_Z_TILE;
+    row < S3L_min(y - y % S3L_Z_TILE + S3L_Z_TILE,S3L_RESOLUTION_Y); ++row)
+    for (S3L_ScreenCoord column = x0; column < x1; ++column)
+      S3L_zBuffer[row * S3L_RESOLUTION_X + column] = S3L_MAX_DEPTH;
+#else
+  S3L_UNUSED(x);
+  S3L_UNUSED(y);
+#endif
+}
+
 #if S3L_Z_BUFFER
 static inline int8_t S3L_zTest(
   S3L_ScreenCoord x,
@@ -845,6 +1082,12 @@ static inline int8_t S3L_zTest(
 S3L_Unit S3L_zBufferRead(S3L_ScreenCoord x, S3L_ScreenCoord y)
 {
 #if S3L_Z_BUFFER
+  #if S3L_Z_BUFFER_TAGS
+  if (S3L_zBufferTags[(y / S3L_Z_TILE) * S3L_Z_TILES_X + x / S3L_Z_TILE] !=
+    S3L_zBufferTag)
+    return S3L_MAX_DEPTH;
+  #endif
+
   return S3L_zBuffer[y * S3L_RESOLUTION_X + x];
 #else
   S3L_UNUSED(x);
@@ -854,10 +1097,103 @@ S3L_Unit S3L_zBufferRead(S3L_ScreenCoord x, S3L_ScreenCoord y)
 #endif
 }
 
+#if S3L_HI_Z
+typedef struct
+{
+  S3L_Unit min;  ///< no pixel of the tile is nearer than this
+  S3L_Unit max;  ///< no pixel of the tile is farther than this
+  uint8_t loose; ///< 1 if the bounds may not be exact since the last write
+} S3L_HiZTile;
+
+S3L_HiZTile S3L_hiZ[S3L_Z_MAX_TILES];
+
+/** Recomputes the exact bounds of a tile of S3L_HI_Z from the z-buffer. */
+static void _S3L_hiZTighten(S3L_ScreenCoord tileX, S3L_ScreenCoord tileY)
+{
+  S3L_HiZTile *tile = S3L_hiZ + tileY * S3L_Z_TILES_X + tileX;
+
+  S3L_ScreenCoord x0 = tileX * S3L_Z_TILE, y0 = tileY * S3L_Z_TILE,
+    x1 = S3L_min(x0 + S3L_Z_TILE,S3L_RESOLUTION_X),
+    y1 = S3L_min(y0 + S3L_Z_TILE,S3L_RESOLUTION_Y);
+
+  S3L_Unit min = S3L_MAX_DEPTH, max = 0;
+
+  for (S3L_ScreenCoord y = y0; y < y1; ++y)
+  {
+    const S3L_Unit *row = S3L_zBuffer + y * S3L_RESOLUTION_X;
+
+    for (S3L_ScreenCoord x = x0; x < x1; ++x)
+    {
+      min = S3L_min(min,row[x]);
+      max = S3L_max(max,row[x]);
+    }
+  }
+
+  tile->min = min;
+  tile->max = max;
+  tile->loose = 0;
+}
+
+/** Checks which of the pixels of a rectangle (given by inclusive corners
+  within the screen) can pass the depth test with depths in <minDepth,
+  maxDepth>. Returns 0 if none can, 2 if all will and 1 otherwise. If tighten
+  is 1, loose tiles are recomputed where that can show they are hidden. */
+static inline uint8_t _S3L_hiZTest(S3L_ScreenCoord x0, S3L_ScreenCoord y0,
+  S3L_ScreenCoord x1, S3L_ScreenCoord y1, S3L_Unit minDepth,
+  S3L_Unit maxDepth, uint8_t tighten)
+{
+  uint8_t hidden = 0, front = 0;
+
+  for (S3L_ScreenCoord tileY = y0 / S3L_Z_TILE;
+    tileY <= y1 / S3L_Z_TILE; ++tileY)
+    for (S3L_ScreenCoord tileX = x0 / S3L_Z_TILE;
+      tileX <= x1 / S3L_Z_TILE; ++tileX)
+    {
+      S3L_HiZTile *tile = S3L_hiZ + tileY * S3L_Z_TILES_X + tileX;
+
+      /* A tile can only turn out hidden if the depths can't be completely in
+         front of it. */
+      if (tighten && tile->loose && minDepth < tile->max &&
+        minDepth >= tile->min)
+        _S3L_hiZTighten(tileX,tileY);
+
+      if (minDepth >= tile->max)
+        hidden = 1;
+      else if (maxDepth < tile->min)
+        front = 1;
+      else
+        return 1;
+
+      if (hidden && front)
+        return 1;
+    }
+
+  return front ? 2 : 0;
+}
+#endif
+
+void S3L_hiZUpdate(S3L_ScreenCoord x, S3L_ScreenCoord y, S3L_Unit value)
+{
+#if S3L_HI_Z
+  S3L_HiZTile *tile = S3L_hiZ + (y / S3L_Z_TILE) * S3L_Z_TILES_X +
+    x / S3L_Z_TILE;
+
+  tile->min = S3L_min(tile->min,value);
+  tile->max = S3L_max(tile->max,value);
+  tile->loose = 1;
+#else
+  S3L_UNUSED(x);
+  S3L_UNUSED(y);
+  S3L_UNUSED(value);
+#endif
+}
+
 void S3L_zBufferWrite(S3L_ScreenCoord x, S3L_ScreenCoord y, S3L_Unit value)
 {
 #if S3L_Z_BUFFER
+  S3L_zBufferTouch(x,y);
   S3L_zBuffer[y * S3L_RESOLUTION_X + x] = value;
+  S3L_hiZUpdate(x,y,value);
 #else
   S3L_UNUSED(x);
   S3L_UNUSED(y);
@@ -1824,6 +2160,7 @@ void S3L_pixelInfoInit(S3L_PixelInfo *p)
   p->triangleID = 0;
   p->depth = 0;
   p->previousZ = 0;
+  p->worker = 0;
 }
 
 void S3L_model3DInit(
@@ -1859,12 +2196,50 @@ void S3L_drawConfigInit(S3L_DrawConfig *config)
   config->visible = 1;
 }
 
+#ifdef S3L_SPAN_FUNCTION
+  static inline void S3L_SPAN_FUNCTION(S3L_SpanInfo *span); // forward decl
+
+  /* The scanline rasterizer still works pixel by pixel, each of its pixels is
+     passed as a span of one. */
+  #define S3L_PIXEL_FUNCTION _S3L_pixelToSpan
+#endif
+
 #ifndef S3L_PIXEL_FUNCTION
   #error Pixel rendering function (S3L_PIXEL_FUNCTION) not specified!
 #endif
 
 static inline void S3L_PIXEL_FUNCTION(S3L_PixelInfo *pixel); // forward decl
 
+#ifdef S3L_SPAN_FUNCTION
+static inline void _S3L_pixelToSpan(S3L_PixelInfo *pixel)
+{
+  S3L_SpanInfo span;
+
+  span.x = pixel->x;
+  span.y = pixel->y;
+  span.length = 1;
+  span.mask = 1;
+
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    span.barycentric[i] = pixel->barycentric[i] * (1 << S3L_SPAN_FRACTION);
+    span.barycentricStep[i] = 0;
+  }
+
+  span.depth = pixel->depth * (1 << S3L_SPAN_FRACTION);
+  span.depthStep = 0;
+  span.previousZ[0] = pixel->previousZ;
+  span.modelIndex = pixel->modelIndex;
+  span.triangleIndex = pixel->triangleIndex;
+  span.triangleID = pixel->triangleID;
+  span.triangleSize[0] = pixel->triangleSize[0];
+  span.triangleSize[1] = pixel->triangleSize[1];
+  span.worker = pixel->worker;
+
+  S3L_SPAN_FUNCTION(&span);
+}
+#endif
+
 /** Serves to accelerate linear interpolation for performance-critical
   code. Functions such as S3L_interpolate require division to compute each
   interpolated value, while S3L_FastLerpState only requires a division for
@@ -1919,10 +2294,29 @@ void S3L_mapProjectionPlaneToScreen(
 
 void S3L_zBufferClear(void)
 {
-#if S3L_Z_BUFFER
+#if S3L_Z_BUFFER_TAGS
+  S3L_zBufferTag++;
+
+  if (S3L_zBufferTag == 0)
+  {
+    for (uint32_t i = 0; i < S3L_Z_TILES_X * S3L_Z_TILES_Y; ++i)
+      S3L_zBufferTags[i] = 0;
+
+    S3L_zBufferTag = 1;
+  }
+#elif S3L_Z_BUFFER
   for (uint32_t i = 0; i < S3L_RESOLUTION_X * S3L_RESOLUTION_Y; ++i)
     S3L_zBuffer[i] = S3L_MAX_DEPTH;
 #endif
+
+#if S3L_HI_Z
+  for (uint32_t i = 0; i < S3L_Z_TILES_X * S3L_Z_TILES_Y; ++i)
+  {
+    S3L_hiZ[i].min = S3L_MAX_DEPTH;
+    S3L_hiZ[i].max = S3L_MAX_DEPTH;
+    S3L_hiZ[i].loose = 0;
+  }
+#endif
 }
 
 void S3L_stencilBufferClear(void)
@@ -1954,132 +2348,796 @@ void S3L_drawTriangle(
   S3L_Index modelIndex,
   S3L_Index triangleIndex)
 {
-  S3L_PixelInfo p;
-  S3L_pixelInfoInit(&p);
-  p.modelIndex = modelIndex;
-  p.triangleIndex = triangleIndex;
-  p.triangleID = (modelIndex << 16) | triangleIndex;
-
-  S3L_Vec4 *tPointSS, *lPointSS, *rPointSS; /* points in Screen Space (in
-                                               S3L_Units, normalized by
-                                               S3L_F) */
-
-  S3L_Unit *barycentric0; // bar. coord that gets higher from L to R
-  S3L_Unit *barycentric1; // bar. coord that gets higher from R to L
-  S3L_Unit *barycentric2; // bar. coord that gets higher from bottom up
+  S3L_drawTriangleClipped(point0,point1,point2,modelIndex,triangleIndex,
+    0,0,S3L_RESOLUTION_X,S3L_RESOLUTION_Y,0);
+}
 
-  // sort the vertices:
+#if S3L_NEAR_CROSS_STRATEGY == 3
+/** Maps the barycentrics of a pixel of a triangle cut by the near plane back
+  to the original triangle. As the mapping is linear, this works for the
+  scaled barycentrics and their steps in S3L_SpanInfo too. */
+static inline void _S3L_remapBarycentrics(S3L_Unit barycentric[3])
+{
+  S3L_Unit newBarycentric[3];
+
+  newBarycentric[0] = S3L_interpolateBarycentric(
+    _S3L_triangleRemapBarycentrics[0].x,
+    _S3L_triangleRemapBarycentrics[1].x,
+    _S3L_triangleRemapBarycentrics[2].x,
+    barycentric);
+
+  newBarycentric[1] = S3L_interpolateBarycentric(
+    _S3L_triangleRemapBarycentrics[0].y,
+    _S3L_triangleRemapBarycentrics[1].y,
+    _S3L_triangleRemapBarycentrics[2].y,
+    barycentric);
+
+  newBarycentric[2] = S3L_interpolateBarycentric(
+    _S3L_triangleRemapBarycentrics[0].z,
+    _S3L_triangleRemapBarycentrics[1].z,
+    _S3L_triangleRemapBarycentrics[2].z,
+    barycentric);
+
+  barycentric[0] = newBarycentric[0];
+  barycentric[1] = newBarycentric[1];
+  barycentric[2] = newBarycentric[2];
+}
+#endif
 
-  #define assignPoints(t,a,b)\
-    {\
-      tPointSS = &point##t;\
-      barycentric2 = &(p.barycentric[t]);\
-      if (S3L_triangleWinding(point##t.x,point##t.y,point##a.x,point##a.y,\
-        point##b.x,point##b.y) >= 0)\
-      {\
-        lPointSS = &point##a; rPointSS = &point##b;\
-        barycentric0 = &(p.barycentric[b]);\
-        barycentric1 = &(p.barycentric[a]);\
-      }\
-      else\
-      {\
-        lPointSS = &point##b; rPointSS = &point##a;\
-        barycentric0 = &(p.barycentric[a]);\
-        barycentric1 = &(p.barycentric[b]);\
-      }\
-    }
+#if S3L_RASTERIZER == 1
+#ifdef __AVX2__
+  #define _S3L_BLOCK 8
+  #define _S3L_BLOCK_SHIFT 3
+#else
+  #define _S3L_BLOCK 4
+  #define _S3L_BLOCK_SHIFT 2
+#endif
 
-  if (point0.y <= point1.y)
-  {
-    if (point0.y <= point2.y)
-      assignPoints(0,1,2)
-    else
-      assignPoints(2,0,1)
-  }
-  else
-  {
-    if (point1.y <= point2.y)
-      assignPoints(1,0,2)
-    else
-      assignPoints(2,0,1)
-  }
+#define _S3L_TILE (_S3L_BLOCK * 4) ///< blocks are first rejected in tiles
+#define _S3L_TILE_CORNERS (_S3L_TILE / _S3L_BLOCK + 1)
+#define _S3L_BLOCK_FRAC S3L_SPAN_FRACTION ///< fraction bits of block values
 
-  #undef assignPoints
+/* One row of a block. Unsigned, so that the interpolation can wrap around:
+   the values of pixels outside the triangle may overflow, but as long as the
+   final value fits, the modular arithmetic gives it exactly. */
+typedef uint32_t _S3L_BlockRow __attribute__((vector_size(_S3L_BLOCK * 4)));
+typedef int32_t _S3L_BlockRowSigned
+  __attribute__((vector_size(_S3L_BLOCK * 4)));
 
-#if S3L_FLAT
-  *barycentric0 = S3L_F / 3;
-  *barycentric1 = S3L_F / 3;
-  *barycentric2 = S3L_F - 2 * (S3L_F / 3);
+typedef struct
+{
+  int32_t a[3], b[3], c[3]; /* edge functions E_i = a * x + b * y + c, edge i
+                               is the one opposite to vertex i, E_i >= 0
+                               inside */
+  int32_t bias[3];          ///< 1 for edges not owning pixels exactly on them
+  int64_t area;             ///< doubled triangle area, > 0
+#if S3L_PERSPECTIVE_CORRECTION
+  int64_t zRecip[3];        ///< reciprocal depths of the vertices
+  int64_t zRecipMin, zRecipMax;
+#else
+  int64_t value[3];         /* barycentric 0, 1 and depth at vertex 0 with 16
+                               fractional bits... */
+  int64_t dx[3], dy[3];     ///< ...and their changes per pixel
+  S3L_Unit x0, y0;
+#endif
+#if S3L_HI_Z
+  S3L_Unit depthRange[2];   ///< bounds of the depths the rasterizer can give
 #endif
+} _S3L_BlockSetup;
 
-  p.triangleSize[0] = rPointSS->x - lPointSS->x;
-  p.triangleSize[1] =
-    (rPointSS->y > lPointSS->y ? rPointSS->y : lPointSS->y) - tPointSS->y;
+/** Tests a square of pixels against the triangle edges, returns 0 if it is
+  fully outside, 1 if it is partially covered and 2 if it is fully inside. */
+static inline uint8_t _S3L_blockTest(const _S3L_BlockSetup *s,
+  S3L_Unit x, S3L_Unit y, S3L_Unit size, int32_t e[3])
+{
+  uint8_t result = 2;
 
-  // now draw the triangle line by line:
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    e[i] = s->a[i] * x + s->b[i] * y + s->c[i];
 
-  S3L_ScreenCoord splitY; // Y of the vertically middle point of the triangle
-  S3L_ScreenCoord endY;   // bottom Y of the whole triangle
-  int splitOnLeft;        /* whether splitY is the y coord. of left or right
-                             point */
+    if (e[i] + (size - 1) * (S3L_max(s->a[i],0) + S3L_max(s->b[i],0)) < 0)
+      return 0;
 
-  if (rPointSS->y <= lPointSS->y)
-  {
-    splitY = rPointSS->y;
-    splitOnLeft = 0;
-    endY = lPointSS->y;
-  }
-  else
-  {
-    splitY = lPointSS->y;
-    splitOnLeft = 1;
-    endY = rPointSS->y;
+    if (e[i] + (size - 1) * (S3L_min(s->a[i],0) + S3L_min(s->b[i],0)) < 0)
+      result = 1;
   }
 
-  S3L_ScreenCoord currentY = tPointSS->y;
-
-  /* We'll be using an algorithm similar to Bresenham line algorithm. The
-     specifics of this algorithm are among others:
+  return result;
+}
 
-     - drawing possibly NON-CONTINUOUS line
-     - NOT tracing the line exactly, but rather rasterizing one the right
-       side of it, according to the pixel CENTERS, INCLUDING the pixel
-       centers
+#if S3L_PERSPECTIVE_CORRECTION
+/** Computes the barycentrics 0 and 1 and depth of a triangle exactly at a
+  given point, which may also lie outside the triangle. */
+static inline void _S3L_blockCorner(const _S3L_BlockSetup *s,
+  int64_t x, int64_t y, uint32_t result[3])
+{
+  int64_t w[3], sum;
 
-     The principle is this:
+  for (uint8_t i = 0; i < 3; ++i)
+    w[i] = (s->a[i] * x + s->b[i] * y + s->c[i] + s->bias[i]) * s->zRecip[i];
 
-     - Move vertically by pixels and accumulate the error (abs(dx/dy)).
-     - If the error is greater than one (crossed the next pixel center), keep
-       moving horizontally and substracting 1 from the error until it is less
-       than 1 again.
-     - To make this INTEGER ONLY, scale the case so that distance between
-       pixels is equal to dy (instead of 1). This way the error becomes
-       dx/dy * dy == dx, and we're comparing the error to (and potentially
-       substracting) 1 * dy == dy. */
+  /* Clamp the interpolated reciprocal to the triangle's range, out of the
+     triangle it could get to zero. */
+  sum = w[0] + w[1] + w[2];
 
-  int16_t
-    /* triangle side:
-    left     right */
-    lX,      rX,       // current x position on the screen
-    lDx,     rDx,      // dx (end point - start point)
-    lDy,     rDy,      // dy (end point - start point)
-    lInc,    rInc,     // direction in which to increment (1 or -1)
-    lErr,    rErr,     // current error (Bresenham)
-    lErrCmp, rErrCmp,  // helper for deciding comparison (> vs >=)
-    lErrAdd, rErrAdd,  // error value to add in each Bresenham cycle
-    lErrSub, rErrSub;  // error value to substract when moving in x direction
+  if (sum < s->zRecipMin * s->area)
+    sum = s->zRecipMin * s->area;
+  else if (sum > s->zRecipMax * s->area)
+    sum = s->zRecipMax * s->area;
 
-  S3L_FastLerpState lSideFLS, rSideFLS;
+  result[0] = (w[0] * S3L_F) / sum;
+  result[1] = (w[1] * S3L_F) / sum;
+  result[2] = (((int64_t) S3L_F * S3L_F * S3L_F) * s->area) / sum;
+}
+#endif
 
-#if S3L_COMPUTE_LERP_DEPTH
-  S3L_FastLerpState lDepthFLS, rDepthFLS;
+#if S3L_HI_Z
+/** Gives the bounds of the depths the rasterizer can give in a square of
+  pixels, for S3L_HI_Z. */
+static inline void _S3L_blockDepthRange(const _S3L_BlockSetup *s,
+  S3L_Unit x, S3L_Unit y, S3L_Unit size, S3L_Unit range[2])
+{
+#if S3L_PERSPECTIVE_CORRECTION || !S3L_COMPUTE_DEPTH
+  S3L_UNUSED(x);
+  S3L_UNUSED(y);
+  S3L_UNUSED(size);
 
-  #define initDepthFLS(s,p1,p2)\
-    s##DepthFLS.valueScaled = p1##PointSS->z << S3L_FAST_LERP_QUALITY;\
-    s##DepthFLS.stepScaled = ((p2##PointSS->z << S3L_FAST_LERP_QUALITY) -\
-      s##DepthFLS.valueScaled) / (s##Dy != 0 ? s##Dy : 1);
+  range[0] = s->depthRange[0];
+  range[1] = s->depthRange[1];
 #else
-  #define initDepthFLS(s,p1,p2) ;
+  /* The depth plane at the square's corners, with a margin for the rounding
+     of the stepping. */
+  int64_t value = s->value[2] + s->dx[2] * (x - s->x0) +
+    s->dy[2] * (y - s->y0),
+    min = value + (size - 1) * ((s->dx[2] < 0 ? s->dx[2] : 0) +
+      (s->dy[2] < 0 ? s->dy[2] : 0)),
+    max = value + (size - 1) * ((s->dx[2] > 0 ? s->dx[2] : 0) +
+      (s->dy[2] > 0 ? s->dy[2] : 0));
+
+  min = (min >> 16) - 2;
+  max = (max >> 16) + 2;
+
+  range[0] = min > s->depthRange[0] ? min : s->depthRange[0];
+  range[1] = max < s->depthRange[1] ? max : s->depthRange[1];
+#endif
+}
+#endif
+
+/** Draws a triangle with the edge function rasterizer (S3L_RASTERIZER 1),
+  parameters are the same as for S3L_drawTriangleClipped. All vertex
+  coordinates must be within S3L_RASTERIZER_MAX_COORD. */
+void _S3L_drawTriangleBlocks(
+  S3L_Vec4 point0,
+  S3L_Vec4 point1,
+  S3L_Vec4 point2,
+  S3L_Index modelIndex,
+  S3L_Index triangleIndex,
+  S3L_ScreenCoord clipX0,
+  S3L_ScreenCoord clipY0,
+  S3L_ScreenCoord clipX1,
+  S3L_ScreenCoord clipY1,
+  uint8_t worker)
+{
+  S3L_Vec4 *points[3] = {&point0, &point1, &point2};
+  _S3L_BlockSetup s;
+
+  s.area = ((int64_t) point1.x - point0.x) * (point2.y - point0.y) -
+    ((int64_t) point1.y - point0.y) * (point2.x - point0.x);
+
+  if (s.area == 0)
+    return;
+
+  S3L_PixelInfo p;
+  S3L_pixelInfoInit(&p);
+  p.worker = worker;
+  p.modelIndex = modelIndex;
+  p.triangleIndex = triangleIndex;
+  p.triangleID = (modelIndex << 16) | triangleIndex;
+
+  S3L_Unit minX = S3L_min(point0.x,S3L_min(point1.x,point2.x)),
+           maxX = S3L_max(point0.x,S3L_max(point1.x,point2.x)),
+           minY = S3L_min(point0.y,S3L_min(point1.y,point2.y)),
+           maxY = S3L_max(point0.y,S3L_max(point1.y,point2.y));
+
+  p.triangleSize[0] = maxX - minX;
+  p.triangleSize[1] = maxY - minY;
+
+#if S3L_FLAT
+  p.barycentric[0] = S3L_F / 3;
+  p.barycentric[1] = S3L_F / 3;
+  p.barycentric[2] = S3L_F - 2 * (S3L_F / 3);
+#endif
+
+#if !S3L_COMPUTE_DEPTH
+  p.depth = (point0.z + point1.z + point2.z) / 3;
+#endif
+
+#ifdef S3L_SPAN_FUNCTION
+  S3L_SpanInfo span;
+
+  span.length = _S3L_BLOCK;
+  span.modelIndex = p.modelIndex;
+  span.triangleIndex = p.triangleIndex;
+  span.triangleID = p.triangleID;
+  span.triangleSize[0] = p.triangleSize[0];
+  span.triangleSize[1] = p.triangleSize[1];
+  span.worker = p.worker;
+
+  for (uint8_t i = 0; i < 3; ++i) // constant unless computed per pixel
+  {
+    span.barycentric[i] = p.barycentric[i] * (1 << _S3L_BLOCK_FRAC);
+    span.barycentricStep[i] = 0;
+  }
+
+  span.depth = p.depth * (1 << _S3L_BLOCK_FRAC);
+  span.depthStep = 0;
+#endif
+
+  minX = S3L_max(minX,clipX0);
+  minY = S3L_max(minY,clipY0);
+  maxX = S3L_min(maxX,clipX1 - 1);
+  maxY = S3L_min(maxY,clipY1 - 1);
+
+  if (minX > maxX || minY > maxY)
+    return;
+
+#if S3L_HI_Z
+  /* Triangles completely behind what has been drawn are skipped before any
+     more setup. */
+  #if !S3L_COMPUTE_DEPTH
+  s.depthRange[0] = p.depth;
+  s.depthRange[1] = p.depth;
+  #else
+  s.depthRange[0] = S3L_min(point0.z,S3L_min(point1.z,point2.z));
+  s.depthRange[1] = S3L_max(point0.z,S3L_max(point1.z,point2.z));
+
+    #if S3L_PERSPECTIVE_CORRECTION
+  // the depths come from rounded reciprocals, see _S3L_blockCorner
+  s.depthRange[1] = (S3L_F * S3L_F * S3L_F) /
+    S3L_nonZero((S3L_F * S3L_F * S3L_F) / S3L_nonZero(s.depthRange[1]));
+    #else
+  s.depthRange[0] -= 2;
+  s.depthRange[1] += 2;
+    #endif
+  #endif
+
+  if (!_S3L_hiZTest(minX,minY,maxX,maxY,s.depthRange[0],S3L_MAX_DEPTH,1))
+    return;
+#endif
+
+  int8_t sign = s.area > 0 ? 1 : -1;
+
+  s.area *= sign;
+
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    const S3L_Vec4 *from = points[(i + 1) % 3], *to = points[(i + 2) % 3];
+
+    s.a[i] = sign * (from->y - to->y);
+    s.b[i] = sign * (to->x - from->x);
+
+    /* Top-left rule: pixels exactly on an edge belong to only one of the two
+       triangles sharing it, so we move the other edges in by one. */
+    s.bias[i] = (s.a[i] > 0 || (s.a[i] == 0 && s.b[i] > 0)) ? 0 : 1;
+    s.c[i] = -1 * (s.a[i] * from->x + s.b[i] * from->y) - s.bias[i];
+
+#if S3L_PERSPECTIVE_CORRECTION
+    s.zRecip[i] = (S3L_F * S3L_F * S3L_F) / S3L_nonZero(points[i]->z);
+#endif
+  }
+
+#if S3L_PERSPECTIVE_CORRECTION
+  s.zRecipMin = S3L_min(s.zRecip[0],S3L_min(s.zRecip[1],s.zRecip[2]));
+  s.zRecipMax = S3L_max(s.zRecip[0],S3L_max(s.zRecip[1],s.zRecip[2]));
+#else
+  /* The values are linear in screen space, so they are only computed exactly
+     at vertex 0 and stepped by fixed point gradients from there. */
+  s.x0 = point0.x;
+  s.y0 = point0.y;
+  s.value[0] = ((int64_t) S3L_F) * 65536;
+  s.value[1] = 0;
+  s.value[2] = ((int64_t) point0.z) * 65536;
+
+  for (uint8_t i = 0; i < 2; ++i)
+  {
+    s.dx[i] = (((int64_t) s.a[i]) * S3L_F * 65536) / s.area;
+    s.dy[i] = (((int64_t) s.b[i]) * S3L_F * 65536) / s.area;
+  }
+
+  s.dx[2] = ((s.a[0] * (int64_t) point0.z + s.a[1] * (int64_t) point1.z +
+    s.a[2] * (int64_t) point2.z) * 65536) / s.area;
+  s.dy[2] = ((s.b[0] * (int64_t) point0.z + s.b[1] * (int64_t) point1.z +
+    s.b[2] * (int64_t) point2.z) * 65536) / s.area;
+#endif
+
+  _S3L_BlockRowSigned lane, laneBits, edgeSteps[3];
+
+  for (uint8_t i = 0; i < _S3L_BLOCK; ++i)
+  {
+    lane[i] = i;
+    laneBits[i] = 1 << i;
+  }
+
+  for (uint8_t i = 0; i < 3; ++i)
+    edgeSteps[i] = s.a[i] * lane;
+
+#if !S3L_PERSPECTIVE_CORRECTION
+  _S3L_BlockRow zero = {0}, valueLaneSteps[3], valueSteps[3];
+
+  for (uint8_t i = 0; i < 3; ++i)
+  {
+    valueLaneSteps[i] = (_S3L_BlockRow) lane *
+      (uint32_t) (s.dx[i] >> (16 - _S3L_BLOCK_FRAC));
+    valueSteps[i] = zero +
+      (uint32_t) (s.dy[i] >> (16 - _S3L_BLOCK_FRAC));
+  }
+#endif
+
+  for (S3L_Unit tileY = minY & ~(_S3L_TILE - 1); tileY <= maxY;
+    tileY += _S3L_TILE)
+    for (S3L_Unit tileX = minX & ~(_S3L_TILE - 1); tileX <= maxX;
+      tileX += _S3L_TILE)
+    {
+      int32_t e[3];
+      uint8_t tileCoverage = _S3L_blockTest(&s,tileX,tileY,_S3L_TILE,e);
+
+      if (tileCoverage == 0)
+        continue;
+
+#if S3L_HI_Z
+      S3L_Unit depthRange[2];
+
+      _S3L_blockDepthRange(&s,tileX,tileY,_S3L_TILE,depthRange);
+
+      uint8_t tileHiZ = _S3L_hiZTest(S3L_max(tileX,minX),
+        S3L_max(tileY,minY),S3L_min(tileX + _S3L_TILE - 1,maxX),
+        S3L_min(tileY + _S3L_TILE - 1,maxY),depthRange[0],depthRange[1],1);
+
+      if (tileHiZ == 0)
+        continue;
+#endif
+
+#if S3L_PERSPECTIVE_CORRECTION
+      /* Exact values are only computed at the block corners and interpolated
+         bilinearly in between. Each corner is shared by up to four blocks of
+         the tile, so they are cached. */
+      uint32_t corners[_S3L_TILE_CORNERS][_S3L_TILE_CORNERS][3];
+      uint32_t cornersValid = 0;
+
+      #define getCorner(column,row,result)\
+        {\
+          uint32_t bit = 1 << ((row) * _S3L_TILE_CORNERS + (column));\
+          if (!(cornersValid & bit))\
+          {\
+            _S3L_blockCorner(&s,tileX + (column) * _S3L_BLOCK,\
+              tileY + (row) * _S3L_BLOCK,corners[row][column]);\
+            cornersValid |= bit;\
+          }\
+          result = corners[row][column];\
+        }
+#endif
+
+      for (S3L_Unit blockY = S3L_max(tileY,minY & ~(_S3L_BLOCK - 1));
+        blockY <= S3L_min(maxY,tileY + _S3L_TILE - 1); blockY += _S3L_BLOCK)
+        for (S3L_Unit blockX = S3L_max(tileX,minX & ~(_S3L_BLOCK - 1));
+          blockX <= S3L_min(maxX,tileX + _S3L_TILE - 1); blockX += _S3L_BLOCK)
+        {
+          uint8_t coverage = tileCoverage == 2 ? 2 :
+            _S3L_blockTest(&s,blockX,blockY,_S3L_BLOCK,e);
+
+          if (coverage == 0)
+            continue;
+
+          /* The values of the first row of the block are start + lane * stepX,
+             each next row adds stepY + lane * stepXY, all with _S3L_BLOCK_FRAC
+             fractional bits. Rows are only stepped by additions, SSE2 has no
+             32 bit multiplication. */
+          _S3L_BlockRow values[3];
+
+#if S3L_PERSPECTIVE_CORRECTION
+          const uint32_t *c00, *c10, *c01, *c11;
+          uint8_t column = (blockX - tileX) >> _S3L_BLOCK_SHIFT,
+                  row = (blockY - tileY) >> _S3L_BLOCK_SHIFT;
+
+          getCorner(column,row,c00)
+          getCorner(column + 1,row,c10)
+          getCorner(column,row + 1,c01)
+          getCorner(column + 1,row + 1,c11)
+
+          _S3L_BlockRow valueSteps[3];
+
+          for (uint8_t i = 0; i < 3; ++i)
+          {
+            values[i] = (c00[i] << _S3L_BLOCK_FRAC) + (_S3L_BlockRow) lane *
+              ((c10[i] - c00[i]) << (_S3L_BLOCK_FRAC - _S3L_BLOCK_SHIFT));
+
+            valueSteps[i] =
+              ((c01[i] - c00[i]) << (_S3L_BLOCK_FRAC - _S3L_BLOCK_SHIFT)) +
+              (_S3L_BlockRow) lane * ((c11[i] - c10[i] - c01[i] + c00[i]) <<
+              (_S3L_BLOCK_FRAC - 2 * _S3L_BLOCK_SHIFT));
+          }
+#else
+          for (uint8_t i = 0; i < 3; ++i)
+            values[i] = ((uint32_t) ((s.value[i] + s.dx[i] * (blockX - s.x0) +
+              s.dy[i] * (blockY - s.y0)) >> (16 - _S3L_BLOCK_FRAC))) +
+              valueLaneSteps[i];
+#endif
+
+#if S3L_HI_Z
+          // 0: the block is hidden, 2: it is in front, no depth test needed
+          uint8_t hiZ = tileHiZ;
+
+          if (hiZ == 1)
+          {
+  #if S3L_PERSPECTIVE_CORRECTION && S3L_COMPUTE_DEPTH
+            // the depths are interpolated between the corners
+            depthRange[0] = S3L_min(S3L_min(c00[2],c10[2]),
+              S3L_min(c01[2],c11[2]));
+            depthRange[1] = S3L_max(S3L_max(c00[2],c10[2]),
+              S3L_max(c01[2],c11[2]));
+  #else
+            _S3L_blockDepthRange(&s,blockX,blockY,_S3L_BLOCK,depthRange);
+  #endif
+
+            /* The tile test has already recomputed what could help, the tiles
+               only got loose by this triangle's own blocks since. */
+            hiZ = _S3L_hiZTest(S3L_max(blockX,minX),S3L_max(blockY,minY),
+              S3L_min(blockX + _S3L_BLOCK - 1,maxX),
+              S3L_min(blockY + _S3L_BLOCK - 1,maxY),depthRange[0],
+              depthRange[1],0);
+
+            if (hiZ == 0)
+              continue;
+          }
+
+          uint8_t written = 0;
+#endif
+
+#if S3L_Z_BUFFER_TAGS
+          S3L_zBufferTouch(blockX,blockY); // a block lies in a single tile
+#endif
+
+          _S3L_BlockRowSigned edges[3];
+
+          for (uint8_t i = 0; i < 3; ++i)
+            edges[i] = e[i] + edgeSteps[i];
+
+          _S3L_BlockRowSigned xs = blockX + lane;
+          _S3L_BlockRowSigned clipMask = (xs >= clipX0) & (xs < clipX1);
+
+          for (uint8_t row = 0; row < _S3L_BLOCK; ++row)
+          {
+            if (row != 0)
+              for (uint8_t i = 0; i < 3; ++i)
+              {
+                values[i] += valueSteps[i];
+                edges[i] += s.b[i];
+              }
+
+            S3L_Unit y = blockY + row;
+
+            if (y < minY || y > maxY)
+              continue;
+
+            _S3L_BlockRowSigned mask = clipMask;
+
+            if (coverage == 1)
+              mask &= (edges[0] | edges[1] | edges[2]) >= 0;
+
+            uint32_t covered = 0; // one bit per pixel
+
+            mask &= laneBits;
+
+            for (uint8_t l = 0; l < _S3L_BLOCK; ++l)
+              covered |= mask[l];
+
+            if (!covered)
+              continue;
+
+#ifdef S3L_SPAN_FUNCTION
+            /* The values are linear along the row, so the whole row is passed
+               as one span. */
+  #if S3L_Z_BUFFER
+    #if S3L_COMPUTE_DEPTH
+            _S3L_BlockRowSigned depths =
+              ((_S3L_BlockRowSigned) values[2]) >> _S3L_BLOCK_FRAC;
+    #else
+            _S3L_BlockRowSigned depths = {0};
+
+            depths += p.depth;
+    #endif
+  #endif
+
+            span.x = blockX;
+            span.y = y;
+            span.mask = 0;
+
+            while (covered)
+            {
+              uint8_t l = __builtin_ctz(covered);
+              covered &= covered - 1;
+
+  #if S3L_STENCIL_BUFFER
+              if (!S3L_stencilTest(blockX + l,y))
+                continue;
+  #endif
+
+  #if S3L_Z_BUFFER
+              span.previousZ[l] =
+                S3L_zBuffer[y * S3L_RESOLUTION_X + blockX + l];
+
+    #if S3L_HI_Z
+              if (hiZ == 2)
+                S3L_zBuffer[y * S3L_RESOLUTION_X + blockX + l] = depths[l];
+              else
+    #endif
+              if (!S3L_zTest(blockX + l,y,depths[l]))
+                continue;
+  #endif
+
+              span.mask |= 1 << l;
+            }
+
+            if (!span.mask)
+              continue;
+
+  #if S3L_HI_Z
+            written = 1;
+  #endif
+
+  #if !S3L_FLAT
+            for (uint8_t i = 0; i < 2; ++i)
+            {
+              span.barycentric[i] = values[i][0];
+              span.barycentricStep[i] = values[i][1] - values[i][0];
+            }
+
+            span.barycentric[2] = S3L_F * (1 << _S3L_BLOCK_FRAC) -
+              span.barycentric[0] - span.barycentric[1];
+            span.barycentricStep[2] =
+              -1 * (span.barycentricStep[0] + span.barycentricStep[1]);
+
+    #if S3L_NEAR_CROSS_STRATEGY == 3
+            if (_S3L_projectedTriangleState != 0)
+            {
+              _S3L_remapBarycentrics(span.barycentric);
+              _S3L_remapBarycentrics(span.barycentricStep);
+            }
+    #endif
+  #endif
+
+  #if S3L_COMPUTE_DEPTH
+            span.depth = values[2][0];
+            span.depthStep = values[2][1] - values[2][0];
+  #endif
+
+            S3L_SPAN_FUNCTION(&span);
+#else // S3L_SPAN_FUNCTION
+  #if !S3L_FLAT
+            _S3L_BlockRowSigned pixelValues[3];
+
+            for (uint8_t i = 0; i < 3; ++i)
+              pixelValues[i] = ((_S3L_BlockRowSigned) values[i]) >>
+                _S3L_BLOCK_FRAC;
+
+            /* Rounding can get the pixels at the edges slightly out of the
+               triangle, clamp so that the barycentrics stay in range. */
+            _S3L_BlockRowSigned limit = {0};
+
+            limit += S3L_F;
+
+            for (uint8_t i = 0; i < 2; ++i)
+            {
+              pixelValues[i] &= pixelValues[i] > 0;
+              pixelValues[i] = (pixelValues[i] & (pixelValues[i] <= limit)) |
+                (limit & (pixelValues[i] > limit));
+              limit -= pixelValues[i];
+            }
+  #endif
+
+            p.y = y;
+
+            while (covered)
+            {
+              uint8_t l = __builtin_ctz(covered);
+              covered &= covered - 1;
+
+              p.x = blockX + l;
+
+  #if S3L_COMPUTE_DEPTH
+              p.depth = pixelValues[2][l];
+  #endif
+
+  #if S3L_STENCIL_BUFFER
+              if (!S3L_stencilTest(p.x,p.y))
+                continue;
+  #endif
+
+  #if S3L_Z_BUFFER
+              p.previousZ = S3L_zBuffer[p.y * S3L_RESOLUTION_X + p.x];
+
+    #if S3L_HI_Z
+              if (hiZ == 2)
+                S3L_zBuffer[p.y * S3L_RESOLUTION_X + p.x] = p.depth;
+              else
+    #endif
+              if (!S3L_zTest(p.x,p.y,p.depth))
+                continue;
+  #endif
+
+  #if S3L_HI_Z
+              written = 1;
+  #endif
+
+  #if !S3L_FLAT
+              p.barycentric[0] = pixelValues[0][l];
+              p.barycentric[1] = pixelValues[1][l];
+              p.barycentric[2] = limit[l];
+  #endif
+
+  #if S3L_NEAR_CROSS_STRATEGY == 3
+              if (_S3L_projectedTriangleState != 0)
+                _S3L_remapBarycentrics(p.barycentric);
+  #endif
+
+              S3L_PIXEL_FUNCTION(&p);
+            }
+#endif // S3L_SPAN_FUNCTION
+          }
+
+#if S3L_HI_Z
+          if (written)
+            S3L_hiZUpdate(blockX,blockY,depthRange[0]);
+#endif
+        }
+
+#if S3L_PERSPECTIVE_CORRECTION
+      #undef getCorner
+#endif
+    }
+}
+#endif // S3L_RASTERIZER == 1
+
+void _S3L_drawTriangleScanline(
+  S3L_Vec4 point0,
+  S3L_Vec4 point1,
+  S3L_Vec4 point2,
+  S3L_Index modelIndex,
+  S3L_Index triangleIndex,
+  S3L_ScreenCoord clipX0,
+  S3L_ScreenCoord clipY0,
+  S3L_ScreenCoord clipX1,
+  S3L_ScreenCoord clipY1,
+  uint8_t worker)
+{
+  S3L_PixelInfo p;
+  S3L_pixelInfoInit(&p);
+  p.worker = worker;
+  p.modelIndex = modelIndex;
+  p.triangleIndex = triangleIndex;
+  p.triangleID = (modelIndex << 16) | triangleIndex;
+
+  S3L_Vec4 *tPointSS, *lPointSS, *rPointSS; /* points in Screen Space (in
+                                               S3L_Units, normalized by
+                                               S3L_F) */
+
+  S3L_Unit *barycentric0; // bar. coord that gets higher from L to R
+  S3L_Unit *barycentric1; // bar. coord that gets higher from R to L
+  S3L_Unit *barycentric2; // bar. coord that gets higher from bottom up
+
+  // sort the vertices:
+
+  #define assignPoints(t,a,b)\
+    {\
+      tPointSS = &point##t;\
+      barycentric2 = &(p.barycentric[t]);\
+      if (S3L_triangleWinding(point##t.x,point##t.y,point##a.x,point##a.y,\
+        point##b.x,point##b.y) >= 0)\
+      {\
+        lPointSS = &point##a; rPointSS = &point##b;\
+        barycentric0 = &(p.barycentric[b]);\
+        barycentric1 = &(p.barycentric[a]);\
+      }\
+      else\
+      {\
+        lPointSS = &point##b; rPointSS = &point##a;\
+        barycentric0 = &(p.barycentric[a]);\
+        barycentric1 = &(p.barycentric[b]);\
+      }\
+    }
+
+  if (point0.y <= point1.y)
+  {
+    if (point0.y <= point2.y)
+      assignPoints(0,1,2)
+    else
+      assignPoints(2,0,1)
+  }
+  else
+  {
+    if (point1.y <= point2.y)
+      assignPoints(1,0,2)
+    else
+      assignPoints(2,0,1)
+  }
+
+  #undef assignPoints
+
+#if S3L_FLAT
+  *barycentric0 = S3L_F / 3;
+  *barycentric1 = S3L_F / 3;
+  *barycentric2 = S3L_F - 2 * (S3L_F / 3);
+#endif
+
+  p.triangleSize[0] = rPointSS->x - lPointSS->x;
+  p.triangleSize[1] =
+    (rPointSS->y > lPointSS->y ? rPointSS->y : lPointSS->y) - tPointSS->y;
+
+  // now draw the triangle line by line:
+
+  S3L_ScreenCoord splitY; // Y of the vertically middle point of the triangle
+  S3L_ScreenCoord endY;   // bottom Y of the whole triangle
+  int splitOnLeft;        /* whether splitY is the y coord. of left or right
+                             point */
+
+  if (rPointSS->y <= lPointSS->y)
+  {
+    splitY = rPointSS->y;
+    splitOnLeft = 0;
+    endY = lPointSS->y;
+  }
+  else
+  {
+    splitY = lPointSS->y;
+    splitOnLeft = 1;
+    endY = rPointSS->y;
+  }
+
+  S3L_ScreenCoord currentY = tPointSS->y;
+
+  /* We'll be using an algorithm similar to Bresenham line algorithm. The
+     specifics of this algorithm are among others:
+
+     - drawing possibly NON-CONTINUOUS line
+     - NOT tracing the line exactly, but rather rasterizing one the right
+       side of it, according to the pixel CENTERS, INCLUDING the pixel
+       centers
+
+     The principle is this:
+
+     - Move vertically by pixels and accumulate the error (abs(dx/dy)).
+     - If the error is greater than one (crossed the next pixel center), keep
+       moving horizontally and substracting 1 from the error until it is less
+       than 1 again.
+     - To make this INTEGER ONLY, scale the case so that distance between
+       pixels is equal to dy (instead of 1). This way the error becomes
+       dx/dy * dy == dx, and we're comparing the error to (and potentially
+       substracting) 1 * dy == dy. */
+
+  int16_t
+    /* triangle side:
+    left     right */
+    lX,      rX,       // current x position on the screen
+    lDx,     rDx,      // dx (end point - start point)
+    lDy,     rDy,      // dy (end point - start point)
+    lInc,    rInc,     // direction in which to increment (1 or -1)
+    lErr,    rErr,     // current error (Bresenham)
+    lErrCmp, rErrCmp,  // helper for deciding comparison (> vs >=)
+    lErrAdd, rErrAdd,  // error value to add in each Bresenham cycle
+    lErrSub, rErrSub;  // error value to substract when moving in x direction
+
+  S3L_FastLerpState lSideFLS, rSideFLS;
+
+#if S3L_COMPUTE_LERP_DEPTH
+  S3L_FastLerpState lDepthFLS, rDepthFLS;
+
+  #define initDepthFLS(s,p1,p2)\
+    s##DepthFLS.valueScaled = p1##PointSS->z << S3L_FAST_LERP_QUALITY;\
+    s##DepthFLS.stepScaled = ((p2##PointSS->z << S3L_FAST_LERP_QUALITY) -\
+      s##DepthFLS.valueScaled) / (s##Dy != 0 ? s##Dy : 1);
+#else
+  #define initDepthFLS(s,p1,p2) ;
 #endif
 
   /* init side for the algorithm, params:
@@ -2162,11 +3220,11 @@ void S3L_drawTriangle(
   #define manageSplitPerspective(b0,b1) ;
 #endif
 
-  // clip to the screen in y dimension:
+  // clip to the screen (or clip rectangle) in y dimension:
 
-  endY = S3L_min(endY,S3L_RESOLUTION_Y);
+  endY = S3L_min(endY,clipY1);
 
-  /* Clipping above the screen (y < 0) can't be easily done here, will be
+  /* Clipping above the screen (y < clipY0) can't be easily done here, will be
      handled inside the loop. */
 
   while (currentY < endY)   /* draw the triangle from top to bottom -- the
@@ -2200,9 +3258,9 @@ void S3L_drawTriangle(
     stepSide(r)
     stepSide(l)
 
-    if (currentY >= 0) /* clipping of pixels whose y < 0 (can't be easily done
-                          outside the loop because of the Bresenham-like
-                          algorithm steps) */
+    if (currentY >= clipY0) /* clipping of pixels whose y < clipY0 (can't be
+                               easily done outside the loop because of the
+                               Bresenham-like algorithm steps) */
     {
       p.y = currentY;
 
@@ -2241,21 +3299,21 @@ void S3L_drawTriangle(
   #endif
 #endif
 
-      // clip to the screen in x dimension:
+      // clip to the screen (or clip rectangle) in x dimension:
 
-      S3L_ScreenCoord rXClipped = S3L_min(rX,S3L_RESOLUTION_X),
+      S3L_ScreenCoord rXClipped = S3L_min(rX,clipX1),
                       lXClipped = lX;
 
-      if (lXClipped < 0)
+      if (lXClipped < clipX0)
       {
-        lXClipped = 0;
+        lXClipped = clipX0;
 
 #if !S3L_PERSPECTIVE_CORRECTION && !S3L_FLAT
-        b0FLS.valueScaled -= lX * b0FLS.stepScaled;
-        b1FLS.valueScaled -= lX * b1FLS.stepScaled;
+        b0FLS.valueScaled += (clipX0 - lX) * b0FLS.stepScaled;
+        b1FLS.valueScaled += (clipX0 - lX) * b1FLS.stepScaled;
 
   #if S3L_COMPUTE_LERP_DEPTH
-        depthFLS.valueScaled -= lX * depthFLS.stepScaled;
+        depthFLS.valueScaled += (clipX0 - lX) * depthFLS.stepScaled;
   #endif
 #endif
       }
@@ -2274,22 +3332,29 @@ void S3L_drawTriangle(
 
       /* ^ These interpolate values between row segments (lines of pixels
            of S3L_PC_APPROX_LENGTH length). After each row segment perspective
-           correction is recomputed. */
+           correction is recomputed. The segments always start at lX, even if
+           the row is clipped, so that the pixels come out the same (up to
+           rounding) no matter where the clipping (e.g. a S3L_BINNING bin)
+           edge is. */
+
+      S3L_ScreenCoord pcSkip = i % S3L_PC_APPROX_LENGTH; // pixels clipped off
+                                                         // the first segment
+      S3L_Unit pcI = i - pcSkip; // start of the current segment
 
       depthPC.valueScaled =
         (Z_RECIP_NUMERATOR /
-        S3L_nonZero(S3L_interpolate(lRecipZ,rRecipZ,i,rowLength)))
+        S3L_nonZero(S3L_interpolate(lRecipZ,rRecipZ,pcI,rowLength)))
         << S3L_FAST_LERP_QUALITY;
 
        b0PC.valueScaled =
            (
-             S3L_interpolateFrom0(rOverZ,i,rowLength)
+             S3L_interpolateFrom0(rOverZ,pcI,rowLength)
              * depthPC.valueScaled
            ) / (Z_RECIP_NUMERATOR / S3L_F);
 
        b1PC.valueScaled =
            (
-             (lOverZ - S3L_interpolateFrom0(lOverZ,i,rowLength))
+             (lOverZ - S3L_interpolateFrom0(lOverZ,pcI,rowLength))
              * depthPC.valueScaled
            ) / (Z_RECIP_NUMERATOR / S3L_F);
 
@@ -2300,6 +3365,16 @@ void S3L_drawTriangle(
       uint32_t zBufferIndex = p.y * S3L_RESOLUTION_X + lXClipped;
 #endif
 
+#if S3L_HI_Z
+      S3L_Unit hiZMin = S3L_MAX_DEPTH; // nearest depth written in the row
+#endif
+
+#if S3L_Z_BUFFER_TAGS
+      for (S3L_ScreenCoord x = lXClipped; x < rXClipped;
+        x = (x / S3L_Z_TILE + 1) * S3L_Z_TILE)
+        S3L_zBufferTouch(x,p.y);
+#endif
+
       // draw the row -- inner loop:
       for (S3L_ScreenCoord x = lXClipped; x < rXClipped; ++x)
       {
@@ -2322,7 +3397,7 @@ void S3L_drawTriangle(
 
           rowCount = 0;
 
-          S3L_Unit nextI = i + S3L_PC_APPROX_LENGTH;
+          S3L_Unit nextI = pcI + S3L_PC_APPROX_LENGTH;
 
           if (nextI < rowLength)
           {
@@ -2361,7 +3436,7 @@ void S3L_drawTriangle(
                actually never reach the extrapolated screen position. So we
                have to clamp to the actual end of the triangle here. */
 
-            S3L_Unit maxI = S3L_nonZero(rowLength - i);
+            S3L_Unit maxI = S3L_nonZero(rowLength - pcI);
 
             S3L_Unit nextDepthScaled =
               (
@@ -2384,6 +3459,19 @@ void S3L_drawTriangle(
             b1PC.stepScaled =
               -1 * b1PC.valueScaled / maxI;
           }
+
+          if (pcSkip)
+          {
+            // skip the clipped pixels of the first segment
+
+            depthPC.valueScaled += pcSkip * depthPC.stepScaled;
+            b0PC.valueScaled += pcSkip * b0PC.stepScaled;
+            b1PC.valueScaled += pcSkip * b1PC.stepScaled;
+            rowCount = pcSkip;
+            pcSkip = 0;
+          }
+
+          pcI = nextI;
         }
 
         p.depth = S3L_getFastLerpValue(depthPC);
@@ -2402,6 +3490,10 @@ void S3L_drawTriangle(
 
         if (!S3L_zTest(p.x,p.y,p.depth))
           testsPassed = 0;
+  #if S3L_HI_Z
+        else if (p.depth < hiZMin)
+          hiZMin = p.depth;
+  #endif
 #endif
 
         if (testsPassed)
@@ -2433,31 +3525,7 @@ void S3L_drawTriangle(
 
 #if S3L_NEAR_CROSS_STRATEGY == 3
           if (_S3L_projectedTriangleState != 0)
-          {
-            S3L_Unit newBarycentric[3];
-
-            newBarycentric[0] = S3L_interpolateBarycentric(
-              _S3L_triangleRemapBarycentrics[0].x,
-              _S3L_triangleRemapBarycentrics[1].x,
-              _S3L_triangleRemapBarycentrics[2].x,
-              p.barycentric);
-
-            newBarycentric[1] = S3L_interpolateBarycentric(
-              _S3L_triangleRemapBarycentrics[0].y,
-              _S3L_triangleRemapBarycentrics[1].y,
-              _S3L_triangleRemapBarycentrics[2].y,
-              p.barycentric);
-
-            newBarycentric[2] = S3L_interpolateBarycentric(
-              _S3L_triangleRemapBarycentrics[0].z,
-              _S3L_triangleRemapBarycentrics[1].z,
-              _S3L_triangleRemapBarycentrics[2].z,
-              p.barycentric);
-
-            p.barycentric[0] = newBarycentric[0];
-            p.barycentric[1] = newBarycentric[1];
-            p.barycentric[2] = newBarycentric[2];
-          }
+            _S3L_remapBarycentrics(p.barycentric);
 #endif
           S3L_PIXEL_FUNCTION(&p);
         } // tests passed
@@ -2478,6 +3546,13 @@ void S3L_drawTriangle(
   #endif
 #endif
       } // inner loop
+
+#if S3L_HI_Z
+      if (hiZMin != S3L_MAX_DEPTH)
+        for (S3L_ScreenCoord x = lXClipped; x < rXClipped;
+          x = (x / S3L_Z_TILE + 1) * S3L_Z_TILE)
+          S3L_hiZUpdate(x,p.y,hiZMin);
+#endif
     } // y clipping
 
 #if !S3L_FLAT
@@ -2500,6 +3575,38 @@ void S3L_drawTriangle(
   #undef Z_RECIP_NUMERATOR
 }
 
+void S3L_drawTriangleClipped(
+  S3L_Vec4 point0,
+  S3L_Vec4 point1,
+  S3L_Vec4 point2,
+  S3L_Index modelIndex,
+  S3L_Index triangleIndex,
+  S3L_ScreenCoord clipX0,
+  S3L_ScreenCoord clipY0,
+  S3L_ScreenCoord clipX1,
+  S3L_ScreenCoord clipY1,
+  uint8_t worker)
+{
+#if S3L_RASTERIZER == 1
+  #define inRange(v) (v >= -S3L_RASTERIZER_MAX_COORD &&\
+    v <= S3L_RASTERIZER_MAX_COORD)
+
+  if (inRange(point0.x) && inRange(point0.y) &&
+      inRange(point1.x) && inRange(point1.y) &&
+      inRange(point2.x) && inRange(point2.y))
+  {
+    _S3L_drawTriangleBlocks(point0,point1,point2,modelIndex,triangleIndex,
+      clipX0,clipY0,clipX1,clipY1,worker);
+    return;
+  }
+
+  #undef inRange
+#endif
+
+  _S3L_drawTriangleScanline(point0,point1,point2,modelIndex,triangleIndex,
+    clipX0,clipY0,clipX1,clipY1,worker);
+}
+
 void S3L_rotate2DPoint(S3L_Unit *x, S3L_Unit *y, S3L_Unit angle)
 {
   if (angle < S3L_SIN_TABLE_UNIT_STEP)
@@ -2824,6 +3931,73 @@ void _S3L_projectTriangle(
   _S3L_mapProjectedVertexToScreen(&transformed[2],focalLength);
 }
 
+#if S3L_VERTEX_CACHE
+S3L_Vec4 S3L_vertexCache[S3L_MAX_CACHED_VERTICES];
+uint8_t S3L_vertexCacheEnabled = 1;
+
+/** Projects all vertices of a model to the screen into S3L_vertexCache, the
+  same way _S3L_projectTriangle does (w keeps the non-clamped z). Returns 0 if
+  the cache is off or the model doesn't fit in it. */
+uint8_t _S3L_cacheModelVertices(
+  const S3L_Model3D *model,
+  S3L_Mat4 matrix,
+  uint32_t focalLength)
+{
+  if (!S3L_vertexCacheEnabled || model->vertexCount > S3L_MAX_CACHED_VERTICES)
+    return 0;
+
+  const S3L_Unit *vertex = model->vertices;
+
+  for (S3L_Index i = 0; i < model->vertexCount; ++i)
+  {
+    S3L_Vec4 *result = &(S3L_vertexCache[i]);
+
+    result->x = vertex[0];
+    result->y = vertex[1];
+    result->z = vertex[2];
+    result->w = S3L_F; // needed for translation
+
+    S3L_vec3Xmat4(result,matrix);
+
+    result->w = result->z;
+
+    _S3L_mapProjectedVertexToScreen(result,focalLength);
+
+    vertex += 3;
+  }
+
+  return 1;
+}
+
+/** Same as _S3L_projectTriangle but takes the vertices from S3L_vertexCache,
+  which must have been filled for the model with _S3L_cacheModelVertices. */
+void _S3L_projectCachedTriangle(
+  const S3L_Model3D *model,
+  S3L_Index triangleIndex,
+  S3L_Mat4 matrix,
+  uint32_t focalLength,
+  S3L_Vec4 transformed[6])
+{
+  const S3L_Index *triangle = model->triangles + triangleIndex * 3;
+
+  transformed[0] = S3L_vertexCache[triangle[0]];
+  transformed[1] = S3L_vertexCache[triangle[1]];
+  transformed[2] = S3L_vertexCache[triangle[2]];
+  _S3L_projectedTriangleState = 0;
+
+#if S3L_NEAR_CROSS_STRATEGY == 2 || S3L_NEAR_CROSS_STRATEGY == 3
+  /* Triangles crossing the near plane have to be cut in camera space, which
+     the cache doesn't have, so these take the full path (they are few). */
+  if (transformed[0].w < S3L_NEAR || transformed[1].w < S3L_NEAR ||
+    transformed[2].w < S3L_NEAR)
+    _S3L_projectTriangle(model,triangleIndex,matrix,focalLength,transformed);
+#else
+  S3L_UNUSED(matrix);
+  S3L_UNUSED(focalLength);
+#endif
+}
+#endif
+
 void S3L_drawScene(S3L_Scene scene)
 {
   S3L_Mat4 matFinal, matCamera;
@@ -2870,12 +4044,22 @@ void S3L_drawScene(S3L_Scene scene)
 
     model = &(scene.models[modelIndex]);
 
+#if S3L_VERTEX_CACHE
+    uint8_t cached =
+      _S3L_cacheModelVertices(model,matFinal,scene.camera.focalLength);
+#endif
+
     while (triangleIndex < triangleCount)
     {
-      /* Some kind of cache could be used in theory to not project perviously
-         already projected vertices, but after some testing this was abandoned,
-         no gain was seen. */
+      /* Without S3L_VERTEX_CACHE each vertex is projected again for every
+         triangle that shares it. */
 
+#if S3L_VERTEX_CACHE
+      if (cached)
+        _S3L_projectCachedTriangle(model,triangleIndex,matFinal,
+          scene.camera.focalLength,transformed);
+      else
+#endif
       _S3L_projectTriangle(model,triangleIndex,matFinal,
         scene.camera.focalLength,transformed);
 
@@ -2994,4 +4178,204 @@ void S3L_drawScene(S3L_Scene scene)
 #endif
 }
 
+#if S3L_BINNING
+typedef struct
+{
+  S3L_Vec4 points[3];      ///< Screen space points, as for S3L_drawTriangle.
+  S3L_Index modelIndex;
+  S3L_Index triangleIndex;
+} _S3L_BinnedTriangle;
+
+_S3L_BinnedTriangle S3L_binnedTriangles[S3L_MAX_BINNED_TRIANGLES];
+uint16_t S3L_binnedTriangleCount;
+
+/* Bin b holds the triangles S3L_binEntries[S3L_binStart[b]] to
+   S3L_binEntries[S3L_binStart[b + 1] - 1], in the order of the scene. */
+uint32_t S3L_binStart[S3L_MAX_BINS + 1];
+uint16_t S3L_binEntries[S3L_MAX_BIN_ENTRIES];
+uint16_t S3L_binsX, S3L_binsY;
+uint32_t S3L_binNext; ///< Next bin to be claimed by S3L_drawBins.
+
+/** Gets the range of bins [x0,x1] x [y0,y1] a binned triangle's bounding
+  box overlaps. */
+static inline void _S3L_binRange(const _S3L_BinnedTriangle *t,
+  int32_t *x0, int32_t *y0, int32_t *x1, int32_t *y1)
+{
+  S3L_Unit minX = S3L_min(t->points[0].x,S3L_min(t->points[1].x,t->points[2].x));
+  S3L_Unit maxX = S3L_max(t->points[0].x,S3L_max(t->points[1].x,t->points[2].x));
+  S3L_Unit minY = S3L_min(t->points[0].y,S3L_min(t->points[1].y,t->points[2].y));
+  S3L_Unit maxY = S3L_max(t->points[0].y,S3L_max(t->points[1].y,t->points[2].y));
+
+  *x0 = S3L_clamp(minX,0,S3L_RESOLUTION_X - 1) / S3L_BIN_SIZE;
+  *x1 = S3L_clamp(maxX,0,S3L_RESOLUTION_X - 1) / S3L_BIN_SIZE;
+  *y0 = S3L_clamp(minY,0,S3L_RESOLUTION_Y - 1) / S3L_BIN_SIZE;
+  *y1 = S3L_clamp(maxY,0,S3L_RESOLUTION_Y - 1) / S3L_BIN_SIZE;
+}
+
+static inline void _S3L_binTriangle(S3L_Vec4 *points, S3L_Index modelIndex,
+  S3L_Index triangleIndex)
+{
+  if (S3L_binnedTriangleCount >= S3L_MAX_BINNED_TRIANGLES)
+    return;
+
+  _S3L_BinnedTriangle *t = &(S3L_binnedTriangles[S3L_binnedTriangleCount]);
+
+  t->points[0] = points[0];
+  t->points[1] = points[1];
+  t->points[2] = points[2];
+  t->modelIndex = modelIndex;
+  t->triangleIndex = triangleIndex;
+
+  S3L_binnedTriangleCount++;
+}
+
+/** First step of binned rendering, to be called on a single core (after
+  S3L_newFrame). Projects all triangles of the scene, the same way
+  S3L_drawScene would, and sorts them into bins. After this S3L_drawBins can
+  be called on any number of cores. */
+void S3L_binScene(S3L_Scene scene)
+{
+  S3L_Mat4 matFinal, matCamera;
+  S3L_Vec4 transformed[6]; // transformed triangle coords, for 2 triangles
+
+  const S3L_Model3D *model;
+  S3L_Index modelIndex, triangleIndex;
+
+  S3L_makeCameraMatrix(scene.camera.transform,matCamera);
+
+  S3L_binnedTriangleCount = 0;
+
+  for (modelIndex = 0; modelIndex < scene.modelCount; ++modelIndex)
+  {
+    if (!scene.models[modelIndex].config.visible)
+      continue;
+
+    if (scene.models[modelIndex].customTransformMatrix == 0)
+      S3L_makeWorldMatrix(scene.models[modelIndex].transform,matFinal);
+    else
+    {
+      S3L_Mat4 *m = scene.models[modelIndex].customTransformMatrix;
+
+      for (int8_t j = 0; j < 4; ++j)
+        for (int8_t i = 0; i < 4; ++i)
+           matFinal[i][j] = (*m)[i][j];
+    }
+
+    S3L_mat4Xmat4(matFinal,matCamera);
+
+    model = &(scene.models[modelIndex]);
+
+#if S3L_VERTEX_CACHE
+    uint8_t cached =
+      _S3L_cacheModelVertices(model,matFinal,scene.camera.focalLength);
+#endif
+
+    for (triangleIndex = 0; triangleIndex < model->triangleCount;
+      ++triangleIndex)
+    {
+#if S3L_VERTEX_CACHE
+      if (cached)
+        _S3L_projectCachedTriangle(model,triangleIndex,matFinal,
+          scene.camera.focalLength,transformed);
+      else
+#endif
+      _S3L_projectTriangle(model,triangleIndex,matFinal,
+        scene.camera.focalLength,transformed);
+
+      if (S3L_triangleIsVisible(transformed[0],transformed[1],transformed[2],
+         model->config.backfaceCulling))
+      {
+        _S3L_binTriangle(transformed,modelIndex,triangleIndex);
+
+        if (_S3L_projectedTriangleState == 2) // potential subtriangle
+          _S3L_binTriangle(transformed + 3,modelIndex,triangleIndex);
+      }
+    }
+  }
+
+  // count the triangles in each bin (shifted by one for the prefix sum)
+
+  S3L_binsX = (S3L_RESOLUTION_X + S3L_BIN_SIZE - 1) / S3L_BIN_SIZE;
+  S3L_binsY = (S3L_RESOLUTION_Y + S3L_BIN_SIZE - 1) / S3L_BIN_SIZE;
+
+  uint32_t bins = S3L_min(S3L_binsX * S3L_binsY,S3L_MAX_BINS);
+  uint32_t total = 0;
+
+  for (uint32_t b = 0; b <= bins; ++b)
+    S3L_binStart[b] = 0;
+
+  for (uint16_t i = 0; i < S3L_binnedTriangleCount; ++i)
+  {
+    int32_t x0, y0, x1, y1;
+
+    _S3L_binRange(&(S3L_binnedTriangles[i]),&x0,&y0,&x1,&y1);
+
+    if (total + (x1 - x0 + 1) * (y1 - y0 + 1) > S3L_MAX_BIN_ENTRIES)
+    {
+      S3L_binnedTriangleCount = i; // out of entries, drop the rest
+      break;
+    }
+
+    for (int32_t y = y0; y <= y1; ++y)
+      for (int32_t x = x0; x <= x1; ++x)
+        if (y * S3L_binsX + x < bins)
+        {
+          S3L_binStart[y * S3L_binsX + x + 1]++;
+          total++;
+        }
+  }
+
+  for (uint32_t b = 0; b < bins; ++b)
+    S3L_binStart[b + 1] += S3L_binStart[b];
+
+  // fill the bins, using binStart[b] as a cursor and shifting it back after
+
+  for (uint16_t i = 0; i < S3L_binnedTriangleCount; ++i)
+  {
+    int32_t x0, y0, x1, y1;
+
+    _S3L_binRange(&(S3L_binnedTriangles[i]),&x0,&y0,&x1,&y1);
+
+    for (int32_t y = y0; y <= y1; ++y)
+      for (int32_t x = x0; x <= x1; ++x)
+        if (y * S3L_binsX + x < bins)
+          S3L_binEntries[S3L_binStart[y * S3L_binsX + x]++] = i;
+  }
+
+  for (uint32_t b = bins; b > 0; --b)
+    S3L_binStart[b] = S3L_binStart[b - 1];
+
+  S3L_binStart[0] = 0;
+
+  S3L_binNext = 0;
+}
+
+/** Second step of binned rendering, can be called from any number of cores at
+  once after S3L_binScene. Keeps claiming bins that no other core has taken
+  yet and draws them, returns when all bins are taken. The worker number is
+  passed on to the pixel function in S3L_PixelInfo. */
+void S3L_drawBins(uint8_t worker)
+{
+  uint32_t bins = S3L_min(S3L_binsX * S3L_binsY,S3L_MAX_BINS);
+  uint32_t b;
+
+  while ((b = __atomic_fetch_add(&S3L_binNext,1,__ATOMIC_RELAXED)) < bins)
+  {
+    S3L_ScreenCoord
+      x0 = (b % S3L_binsX) * S3L_BIN_SIZE,
+      y0 = (b / S3L_binsX) * S3L_BIN_SIZE,
+      x1 = S3L_min(x0 + S3L_BIN_SIZE,S3L_RESOLUTION_X),
+      y1 = S3L_min(y0 + S3L_BIN_SIZE,S3L_RESOLUTION_Y);
+
+    for (uint32_t e = S3L_binStart[b]; e < S3L_binStart[b + 1]; ++e)
+    {
+      const _S3L_BinnedTriangle *t = &(S3L_binnedTriangles[S3L_binEntries[e]]);
+
+      S3L_drawTriangleClipped(t->points[0],t->points[1],t->points[2],
+        t->modelIndex,t->triangleIndex,x0,y0,x1,y1,worker);
+    }
+  }
+}
+#endif // S3L_BINNING
+
 #endif // guard
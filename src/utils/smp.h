@@ -0,0 +1,396 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+#include "../libBareMetal.h"
+#include "topology.h" // cpu_table
+
+// Locks, counters and barriers spinning in user code rather than calling the
+// kernel (SMP_LOCK, SMP_BUSY). Whatever is written by several cores sits on a
+// cache line of its own, and waiting cores back off with pause so the line
+// they watch isn't taken from the core about to write it.
+
+#ifndef SMP_BACKOFF
+#define SMP_BACKOFF 64 // most pauses between two looks at a line being waited on
+#endif
+
+// Pauses *delay times and doubles *delay, up to SMP_BACKOFF. Start *delay
+// at 1.
+static inline void smp_backoff(uint32_t *delay) {
+	for (uint32_t i = 0; i < *delay; i++)
+		asm volatile ("pause");
+	if (*delay < SMP_BACKOFF)
+		*delay *= 2;
+}
+
+// A counter alone on its cache line, for work handed out with fetch-add or
+// for counts kept per core
+typedef struct {
+	uint64_t value;
+} __attribute__((aligned(64))) smp_counter;
+
+// Adds n, returns the value before
+static inline uint64_t smp_counterAdd(smp_counter *c, uint64_t n) {
+	return __atomic_fetch_add(&c->value, n, __ATOMIC_RELAXED);
+}
+
+// Sum of n counters, one per core for instance
+static inline uint64_t smp_counterSum(smp_counter *c, uint32_t n) {
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum += __atomic_load_n(&c[i].value, __ATOMIC_RELAXED);
+	return sum;
+}
+
+// A ticket lock: cores get the lock in the order they asked for it, and wait
+// longer the further back in line they are. Zero is unlocked.
+typedef struct {
+	uint32_t next __attribute__((aligned(64)));      // next ticket handed out
+	uint32_t serving __attribute__((aligned(64)));   // ticket holding the lock
+} smp_ticketLock;
+
+static inline void smp_ticketAcquire(smp_ticketLock *lock) {
+	uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	uint32_t serving;
+
+	while ((serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE)) != ticket)
+		for (uint32_t i = 0; i < (ticket - serving) * SMP_BACKOFF; i++)
+			asm volatile ("pause");
+}
+
+static inline void smp_ticketRelease(smp_ticketLock *lock) {
+	__atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+}
+
+// An MCS lock: every waiting core spins on its own node, so handing the lock
+// over touches only the line of the next core in line. The node is the
+// caller's (on its stack for instance) until the release. Zero is unlocked.
+typedef struct smp_mcsNode {
+	struct smp_mcsNode *next;
+	uint32_t locked;
+} __attribute__((aligned(64))) smp_mcsNode;
+
+typedef struct {
+	smp_mcsNode *tail;                 // last core in line
+} __attribute__((aligned(64))) smp_mcsLock;
+
+static inline void smp_mcsAcquire(smp_mcsLock *lock, smp_mcsNode *node) {
+	node->next = 0;
+	node->locked = 1;
+
+	smp_mcsNode *previous = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (!previous)
+		return;
+	__atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		asm volatile ("pause");
+}
+
+static inline void smp_mcsRelease(smp_mcsLock *lock, smp_mcsNode *node) {
+	smp_mcsNode *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		smp_mcsNode *last = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &last, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		// A core is in line but hasn't linked its node yet
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			asm volatile ("pause");
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+// A sense-reversing barrier for a fixed number of cores. Each core keeps its
+// own sense, starting at 0, and passes it to every smp_barrierWait. The
+// barrier can be used again right away.
+typedef struct {
+	uint32_t count __attribute__((aligned(64)));   // cores yet to arrive
+	uint32_t cores;
+	uint32_t sense __attribute__((aligned(64)));   // flipped by the last core
+} smp_barrier;
+
+static inline void smp_barrierInit(smp_barrier *barrier, uint32_t cores) {
+	barrier->count = barrier->cores = cores;
+	barrier->sense = 0;
+}
+
+// Returns once every core has called it
+static inline void smp_barrierWait(smp_barrier *barrier, uint32_t *sense) {
+	uint32_t s = *sense ^= 1;
+
+	if (__atomic_sub_fetch(&barrier->count, 1, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_store_n(&barrier->count, barrier->cores, __ATOMIC_RELAXED);
+		__atomic_store_n(&barrier->sense, s, __ATOMIC_RELEASE);
+		return;
+	}
+
+	uint32_t delay = 1;
+	while (__atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE) != s)
+		smp_backoff(&delay);
+}
+
+// A pool of workers for work split into tasks, so a short job such as a band
+// of a frame doesn't pay for an SMP_SET on every core.
+//
+// smp_init makes the calling core worker 0 and the other cores workers 1 and
+// up, in the order of topology.order, so the first workers started are on
+// cores of their own and near each other. A worker is started with SMP_SET
+// when there is work for it, then takes tasks from a lock-free queue shared
+// by every core. Once it has found no task for SMP_SPIN TSC ticks it returns,
+// handing the core back to the kernel, and is started again by the next task.
+// smp_submit queues a task, smp_wait waits for the tasks of a future, running
+// queued tasks meanwhile, and smp_parallelFor splits a range of numbers into
+// tasks. Tasks are called with the number of the worker running them, for
+// perf.h and such.
+//
+// The queue is bounded: a task submitted to a full queue is run by the core
+// submitting it.
+
+#ifndef SMP_MAX_CORES
+#define SMP_MAX_CORES 256
+#endif
+
+#ifndef SMP_QUEUE_SIZE
+#define SMP_QUEUE_SIZE 256 // tasks, a power of 2
+#endif
+
+#ifndef SMP_SPIN
+#define SMP_SPIN (1 << 22) // TSC ticks an idle worker waits for a task, a few ms
+#endif
+
+typedef void (*smp_function)(void *arg, uint32_t worker);
+typedef void (*smp_range)(uint32_t begin, uint32_t end, void *arg, uint32_t worker);
+
+// Counts the tasks submitted with it that aren't done yet
+typedef struct {
+	uint32_t pending;
+} smp_future;
+
+// A slot of the queue, free for the push at position p when sequence is p
+// and holding the task for the pop at position p when sequence is p + 1
+typedef struct {
+	uint64_t sequence;
+	smp_function function;
+	void *arg;
+	smp_future *future;
+} smp_task;
+
+static struct {
+	uint32_t workers;                  // worker 0 being the core of smp_init
+	uint8_t core[SMP_MAX_CORES];       // APIC ID of every worker
+	uint8_t workerOf[SMP_MAX_CORES];   // worker of every APIC ID
+	uint32_t running[SMP_MAX_CORES];   // the worker is started on its core
+	uint32_t parked;                   // workers not started
+	uint32_t stopping;
+
+	uint64_t head __attribute__((aligned(64)));   // next position to pop
+	uint64_t tail __attribute__((aligned(64)));   // next position to push
+	smp_task task[SMP_QUEUE_SIZE] __attribute__((aligned(64)));
+} smp;
+
+// Sets up the pool with every core but skip (fb.presenter for instance, or
+// the calling core to skip none)
+static inline void smp_init(uint32_t skip) {
+	uint32_t self = b_system(SMP_ID, 0, 0);
+
+	topology_init();
+	smp.core[0] = self;
+	smp.workerOf[self] = 0;
+	smp.workers = 1;
+	for (uint32_t i = 0; i < topology.cores && smp.workers < SMP_MAX_CORES; i++) {
+		uint32_t c = topology.order[i];
+		if (c == self || c == skip)
+			continue;
+		smp.workerOf[c] = smp.workers;
+		smp.running[smp.workers] = 0;
+		smp.core[smp.workers++] = c;
+	}
+	smp.parked = smp.workers - 1;
+	smp.stopping = 0;
+
+	smp.head = smp.tail = 0;
+	for (uint64_t i = 0; i < SMP_QUEUE_SIZE; i++)
+		smp.task[i].sequence = i;
+}
+
+// Number of the calling worker
+static inline uint32_t smp_self() {
+	return smp.workerOf[b_system(SMP_ID, 0, 0) % SMP_MAX_CORES];
+}
+
+// Adds a task to the queue, returns 0 when it is full
+static inline int smp_push(smp_function function, void *arg, smp_future *future) {
+	uint64_t position = __atomic_load_n(&smp.tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		smp_task *t = &smp.task[position & (SMP_QUEUE_SIZE - 1)];
+		int64_t d = __atomic_load_n(&t->sequence, __ATOMIC_ACQUIRE) - position;
+		if (d < 0)
+			return 0;
+		if (d > 0) {
+			position = __atomic_load_n(&smp.tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		// On failure position is updated to the current tail
+		if (__atomic_compare_exchange_n(&smp.tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			t->function = function;
+			t->arg = arg;
+			t->future = future;
+			__atomic_store_n(&t->sequence, position + 1, __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+}
+
+// Takes a task off the queue and runs it, returns 0 when there was none
+static inline int smp_runNext(uint32_t worker) {
+	uint64_t position = __atomic_load_n(&smp.head, __ATOMIC_RELAXED);
+	smp_task *t;
+
+	for (;;) {
+		t = &smp.task[position & (SMP_QUEUE_SIZE - 1)];
+		int64_t d = __atomic_load_n(&t->sequence, __ATOMIC_ACQUIRE) - (position + 1);
+		if (d < 0)
+			return 0;
+		if (d > 0) {
+			position = __atomic_load_n(&smp.head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&smp.head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	smp_function function = t->function;
+	void *arg = t->arg;
+	smp_future *future = t->future;
+	__atomic_store_n(&t->sequence, position + SMP_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+	function(arg, worker);
+	if (future)
+		__atomic_sub_fetch(&future->pending, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Entry point of workers 1 and up
+__attribute__((force_align_arg_pointer)) static inline void smp_worker(void) {
+	uint32_t worker = smp_self();
+	uint64_t idle = __builtin_ia32_rdtsc();
+
+	for (;;) {
+		if (smp_runNext(worker)) {
+			idle = __builtin_ia32_rdtsc();
+			continue;
+		}
+		if (__builtin_ia32_rdtsc() - idle < SMP_SPIN && !__atomic_load_n(&smp.stopping, __ATOMIC_RELAXED)) {
+			asm volatile ("pause");
+			continue;
+		}
+
+		// Parks, unless a task came in meanwhile and smp_wake didn't start
+		// this worker again for it already
+		__atomic_store_n(&smp.running[worker], 0, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&smp.parked, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&smp.stopping, __ATOMIC_SEQ_CST) ||
+			__atomic_load_n(&smp.head, __ATOMIC_SEQ_CST) == __atomic_load_n(&smp.tail, __ATOMIC_SEQ_CST))
+			return;
+		uint32_t parked = 0;
+		if (!__atomic_compare_exchange_n(&smp.running[worker], &parked, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return;
+		__atomic_sub_fetch(&smp.parked, 1, __ATOMIC_RELAXED);
+		idle = __builtin_ia32_rdtsc();
+	}
+}
+
+// Starts up to n parked workers for the tasks just queued
+static inline void smp_wake(uint32_t n) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (uint32_t w = 1; w < smp.workers && n && __atomic_load_n(&smp.parked, __ATOMIC_RELAXED); w++) {
+		uint32_t parked = 0;
+		if (__atomic_load_n(&smp.running[w], __ATOMIC_RELAXED) ||
+			!__atomic_compare_exchange_n(&smp.running[w], &parked, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			continue;
+		__atomic_sub_fetch(&smp.parked, 1, __ATOMIC_RELAXED);
+		b_system(SMP_SET, (uint64_t)smp_worker, smp.core[w]);
+		n--;
+	}
+}
+
+// Queues function(arg, worker) without starting a worker for it
+static inline void smp_queue(smp_function function, void *arg, smp_future *future) {
+	if (future)
+		__atomic_add_fetch(&future->pending, 1, __ATOMIC_RELAXED);
+	if (smp_push(function, arg, future))
+		return;
+
+	function(arg, smp_self());
+	if (future)
+		__atomic_sub_fetch(&future->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Runs function(arg, worker) on some worker, future (or 0) counting it
+static inline void smp_submit(smp_function function, void *arg, smp_future *future) {
+	smp_queue(function, arg, future);
+	smp_wake(1);
+}
+
+static inline int smp_done(smp_future *future) {
+	return __atomic_load_n(&future->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Waits for the tasks of future, running queued tasks meanwhile
+static inline void smp_wait(smp_future *future) {
+	uint32_t worker = smp_self();
+
+	while (!smp_done(future))
+		if (!smp_runNext(worker))
+			asm volatile ("pause");
+}
+
+// The counter is apart from what the cores only read
+typedef struct {
+	uint32_t end, grain;
+	smp_range function;
+	void *arg;
+	smp_counter next;
+} smp_loop;
+
+static inline void smp_loopTask(void *arg, uint32_t worker) {
+	smp_loop *loop = arg;
+	uint64_t i;
+
+	while ((i = smp_counterAdd(&loop->next, loop->grain)) < loop->end)
+		loop->function(i, i + loop->grain < loop->end ? i + loop->grain : loop->end, loop->arg, worker);
+}
+
+// Calls function(b, e, arg, worker) for pieces b to e (not included) of
+// begin to end, grain numbers each but the last, on the calling core and as
+// many workers as there are pieces for. Returns when all are done.
+static inline void smp_parallelFor(uint32_t begin, uint32_t end, uint32_t grain, smp_range function, void *arg) {
+	if (begin >= end)
+		return;
+	if (!grain)
+		grain = 1;
+
+	smp_loop loop = {end, grain, function, arg, {begin}};
+	smp_future future = {0};
+	uint64_t pieces = ((uint64_t)end - begin + grain - 1) / grain;
+	uint32_t helpers = pieces - 1 < smp.workers - 1 ? pieces - 1 : smp.workers - 1;
+
+	for (uint32_t i = 0; i < helpers; i++)
+		smp_queue(smp_loopTask, &loop, &future);
+	smp_wake(helpers);
+
+	smp_loopTask(&loop, smp_self());
+	smp_wait(&future);
+}
+
+// Has every worker return to the kernel, once all tasks are done. Call before
+// the program ends. The pool starts again with the next task.
+static inline void smp_stop() {
+	__atomic_store_n(&smp.stopping, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&smp.parked, __ATOMIC_ACQUIRE) != smp.workers - 1)
+		asm volatile ("pause");
+	__atomic_store_n(&smp.stopping, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <stdint.h>
+#include "../libBareMetal.h"
+
+// Where the kernel lists the APIC IDs of the active cores, one byte each, in
+// the order of SMP_NUMCORES
+#ifndef SMP_CPU_TABLE
+#define SMP_CPU_TABLE 0x5100
+#endif
+
+static uint8_t *const cpu_table = (uint8_t *)SMP_CPU_TABLE;
+
+// Which cores share a physical core (SMT threads) and which share a package.
+//
+// An APIC ID is made of the SMT thread number in its low bits, the core
+// number above and the package number in the high bits. CPUID leaf 0x1F, or
+// 0xB before it, gives the width of each part for the whole system, so the
+// IDs of cpu_table are taken apart without running anything on the other
+// cores. CPUs without either leaf are covered by leaves 1 and 4 on Intel,
+// and on AMD, which has no leaf 4, by leaves 0x80000008 and 0x8000001E or
+// else with every thread a core of its own. With none of them every core is
+// a package of one.
+//
+// The package stands in for the memory node: BareMetal doesn't pass the ACPI
+// SRAT on, and on the machines it runs on the two match.
+
+typedef struct {
+	uint8_t package;                   // physical package (socket)
+	uint8_t core;                      // core in the package
+	uint8_t thread;                    // SMT thread in the core, 0 for the first
+} topology_cpu;
+
+static struct {
+	uint32_t cores, packages;
+	uint32_t smtShift;                 // bits of the thread in the APIC ID
+	uint32_t packageShift;             // bits of the thread and core
+	topology_cpu cpu[256];             // by APIC ID
+	uint8_t order[256];                // APIC IDs, see topology_init
+} topology;
+
+static inline void topology_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4]) {
+	asm volatile ("cpuid" : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3]) : "a"(leaf), "c"(subleaf));
+}
+
+// Bits needed for numbers up to n - 1
+static inline uint32_t topology_bits(uint32_t n) {
+	uint32_t bits = 0;
+	while ((1u << bits) < n)
+		bits++;
+	return bits;
+}
+
+// Finds the topology of the cores of cpu_table and orders them in
+// topology.order: the first thread of every core before any second thread,
+// so work for fewer cores than there are goes to cores of their own, and
+// within that by package and core, so cores next in the order share caches.
+static inline void topology_init() {
+	uint32_t r[4], maxLeaf;
+
+	topology_cpuid(0, 0, r);
+	maxLeaf = r[0];
+	topology.smtShift = topology.packageShift = 0;
+
+	// A leaf that isn't implemented has no logical processors at level 0
+	uint32_t leaf = 0;
+	if (maxLeaf >= 0x1F && (topology_cpuid(0x1F, 0, r), r[1]))
+		leaf = 0x1F;
+	else if (maxLeaf >= 0xB && (topology_cpuid(0xB, 0, r), r[1]))
+		leaf = 0xB;
+
+	if (leaf) {
+		// The levels go up from SMT, the shift of the last one is the package's
+		for (uint32_t level = 0; level < 8; level++) {
+			topology_cpuid(leaf, level, r);
+			uint32_t type = (r[2] >> 8) & 0xFF;
+			if (!type)
+				break;
+			if (type == 1)
+				topology.smtShift = r[0] & 0x1F;
+			topology.packageShift = r[0] & 0x1F;
+		}
+	} else if (maxLeaf >= 1) {
+		topology_cpuid(1, 0, r);
+		if (r[3] & (1 << 28)) {                    // HTT, more than one thread per package
+			uint32_t threads = (r[1] >> 16) & 0xFF, cores = 0, threadsPerCore = 1;
+			topology.packageShift = topology_bits(threads);
+
+			// Leaf 4 describes the caches, a reserved leaf describes none
+			if (maxLeaf >= 4) {
+				topology_cpuid(4, 0, r);
+				if (r[0] & 0x1F)
+					cores = (r[0] >> 26) + 1;
+			}
+
+			if (cores) {
+				threadsPerCore = threads / cores;
+			} else {
+				// AMD: the width of the core ID, and the threads of a core
+				// where the CPU has topology extensions
+				topology_cpuid(0x80000000, 0, r);
+				uint32_t maxExtended = r[0];
+				topology_cpuid(0x80000001, 0, r);
+				uint32_t extensions = r[2] & (1 << 22);
+				if (maxExtended >= 0x80000008) {
+					topology_cpuid(0x80000008, 0, r);
+					if ((r[2] >> 12) & 0xF)
+						topology.packageShift = (r[2] >> 12) & 0xF;
+				}
+				if (maxExtended >= 0x8000001E && extensions) {
+					topology_cpuid(0x8000001E, 0, r);
+					threadsPerCore = ((r[1] >> 8) & 0xFF) + 1;
+				}
+			}
+			topology.smtShift = topology_bits(threadsPerCore > 1 ? threadsPerCore : 1);
+		}
+	}
+	if (topology.packageShift < topology.smtShift)
+		topology.packageShift = topology.smtShift;
+
+	topology.cores = b_system(SMP_NUMCORES, 0, 0);
+	if (topology.cores > 256)
+		topology.cores = 256;
+	topology.packages = 0;
+	for (uint32_t i = 0; i < topology.cores; i++) {
+		uint32_t id = cpu_table[i];
+		topology_cpu *c = &topology.cpu[id];
+		c->thread = id & ((1u << topology.smtShift) - 1);
+		c->core = (id & ((1u << topology.packageShift) - 1)) >> topology.smtShift;
+		c->package = topology.packageShift < 8 ? id >> topology.packageShift : 0;
+		if (c->package >= topology.packages)
+			topology.packages = c->package + 1;
+	}
+
+	// Insertion sort on thread, package and core
+	for (uint32_t i = 0; i < topology.cores; i++) {
+		uint8_t id = cpu_table[i];
+		topology_cpu *c = &topology.cpu[id];
+		uint32_t key = c->thread << 16 | c->package << 8 | c->core, j = i;
+		for (; j > 0; j--) {
+			topology_cpu *d = &topology.cpu[topology.order[j - 1]];
+			if ((uint32_t)(d->thread << 16 | d->package << 8 | d->core) <= key)
+				break;
+			topology.order[j] = topology.order[j - 1];
+		}
+		topology.order[j] = id;
+	}
+}
+
+#endif